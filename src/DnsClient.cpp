@@ -0,0 +1,422 @@
+/*
+ * (C) 2011 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "DnsClient.hpp"
+#include "Utils.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+
+// without EDNS answers are not bigger than 512
+#define DNS_MAX_PACKET 1500
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_PTR 12
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NXDOMAIN 3
+// longest CNAME chain followed from question to PTR
+#define DNS_MAX_CNAMES 8
+// random bytes read at once, two per id
+#define DNS_RANDOM_BYTES 512
+
+// resource record of answer section
+struct DnsRecord {
+   // lowercased
+   std::string owner;
+   int type;
+   long ttl;
+   // offset of rdata in packet
+   size_t rdata;
+};
+
+DnsClient::DnsClient() : timeout(DNS_TIMEOUT), attempts(DNS_ATTEMPTS), random_pos(0) {
+   sockets[0] = sockets[1] = -1;
+   socket_sent[0] = socket_sent[1] = 0;
+   random_fd = open("/dev/urandom", O_RDONLY);
+   if (random_fd >= 0) fcntl(random_fd, F_SETFD, FD_CLOEXEC);
+   id_state = static_cast<uint32_t>(time(NULL)) ^ (static_cast<uint32_t>(getpid()) << 16) ^
+              static_cast<uint32_t>(Utils::MonotonicUs());
+   if (id_state == 0) id_state = 1;
+}
+
+DnsClient::~DnsClient() {
+   for (map<int, int>::iterator it = socket_users.begin(); it != socket_users.end(); ++it) {
+      if ((it->first != sockets[0]) && (it->first != sockets[1])) close(it->first);
+   }
+   for (int i = 0; i < 2; ++i) {
+      if (sockets[i] >= 0) close(sockets[i]);
+   }
+   if (random_fd >= 0) close(random_fd);
+}
+
+bool DnsClient::Open(const string& resolv_conf) {
+   std::ifstream conf(resolv_conf.c_str());
+   string line;
+   while (std::getline(conf, line)) {
+      string::size_type comment = line.find_first_of("#;");
+      if (comment != string::npos) line.erase(comment);
+      std::istringstream words(line);
+      string key, value;
+      words >> key;
+      if (key == "nameserver") {
+         if ((words >> value) && (servers.size() < DNS_MAX_SERVERS))
+            AddServer(value);
+      } else if (key == "options") {
+         while (words >> value) {
+            // limits are the same as in resolver(3)
+            if (value.compare(0, 8, "timeout:") == 0)
+               timeout = std::min(std::max(atoi(value.c_str() + 8), 1), 30);
+            else if (value.compare(0, 9, "attempts:") == 0)
+               attempts = std::min(std::max(atoi(value.c_str() + 9), 1), 5);
+         }
+      }
+   }
+   return !servers.empty();
+}
+
+bool DnsClient::AddServer(const string& addr, int port) {
+   Server server;
+   memset(&server.addr, 0, sizeof server.addr);
+   struct sockaddr_in* sin = reinterpret_cast<struct sockaddr_in*>(&server.addr);
+   struct sockaddr_in6* sin6 = reinterpret_cast<struct sockaddr_in6*>(&server.addr);
+   int family;
+   if (inet_pton(AF_INET, addr.c_str(), &sin->sin_addr) == 1) {
+      family = sin->sin_family = AF_INET;
+      sin->sin_port = htons(port);
+      server.addr_len = sizeof *sin;
+      server.socket = 0;
+   } else if (inet_pton(AF_INET6, addr.c_str(), &sin6->sin6_addr) == 1) {
+      family = sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(port);
+      server.addr_len = sizeof *sin6;
+      server.socket = 1;
+   } else {
+      return false;
+   }
+   if (sockets[server.socket] < 0) {
+      int fd = OpenSocket(family);
+      if (fd < 0) return false;
+      sockets[server.socket] = fd;
+   }
+   servers.push_back(server);
+   return true;
+}
+
+/* static */ int DnsClient::OpenSocket(int family) {
+   // not bound, so first sendto takes random ephemeral port
+   int fd = socket(family, SOCK_DGRAM, 0);
+   if (fd < 0) return -1;
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+   fcntl(fd, F_SETFD, FD_CLOEXEC);
+   return fd;
+}
+
+int DnsClient::SendSocket(int index) {
+   if (socket_sent[index] >= DNS_SOCKET_QUERIES) {
+      socket_sent[index] = 0;
+      int fd = OpenSocket((index == 0) ? AF_INET : AF_INET6);
+      // old one is used further if new one can't be opened
+      if (fd >= 0) {
+         int old = sockets[index];
+         sockets[index] = fd;
+         if (socket_users.find(old) == socket_users.end()) close(old);
+      }
+   }
+   socket_sent[index]++;
+   return sockets[index];
+}
+
+void DnsClient::Release(int fd) {
+   map<int, int>::iterator it = socket_users.find(fd);
+   if ((it == socket_users.end()) || (--it->second > 0)) return;
+   socket_users.erase(it);
+   if ((fd != sockets[0]) && (fd != sockets[1])) close(fd);
+}
+
+/* static */ bool DnsClient::ReverseName(const string& ip, string& qname) {
+   static const char hex[] = "0123456789abcdef";
+   unsigned char addr[16];
+   const unsigned char* v4 = NULL;
+   if (inet_pton(AF_INET, ip.c_str(), addr) == 1) {
+      v4 = addr;
+   } else if (inet_pton(AF_INET6, ip.c_str(), addr) == 1) {
+      // ::ffff:a.b.c.d has its PTR record under in-addr.arpa
+      static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+      if (memcmp(addr, mapped, sizeof mapped) == 0) v4 = addr + 12;
+   } else {
+      return false;
+   }
+   qname.clear();
+   if (v4 != NULL) {
+      for (int i = 3; i >= 0; --i)
+         qname += Utils::itos(v4[i]) + ".";
+      qname += "in-addr.arpa";
+   } else {
+      for (int i = 15; i >= 0; --i) {
+         qname += hex[addr[i] & 0xf];
+         qname += '.';
+         qname += hex[addr[i] >> 4];
+         qname += '.';
+      }
+      qname += "ip6.arpa";
+   }
+   return true;
+}
+
+unsigned short DnsClient::NextId() {
+   if (random_pos + 2 > random.size()) {
+      random.resize(DNS_RANDOM_BYTES);
+      ssize_t got = (random_fd >= 0) ? read(random_fd, &random[0], random.size()) : -1;
+      random.resize(std::max(got, static_cast<ssize_t>(0)));
+      random_pos = 0;
+   }
+   if (random_pos + 2 <= random.size()) {
+      unsigned short id = (random[random_pos] << 8) | random[random_pos + 1];
+      random_pos += 2;
+      return id;
+   }
+   // xorshift32, predictable by whoever sees some of ids, only for /dev/urandom missing (e.g. chroot)
+   id_state ^= id_state << 13;
+   id_state ^= id_state >> 17;
+   id_state ^= id_state << 5;
+   return static_cast<unsigned short>(id_state >> 8);
+}
+
+bool DnsClient::Query(const string& ip) {
+   if (servers.empty()) return false;
+   Pending pending;
+   if (!ReverseName(ip, pending.qname)) return false;
+   pending.ip = ip;
+   pending.tries = 0;
+   pending.fd = -1;
+   unsigned short id;
+   do {
+      id = NextId();
+   } while (in_flight.find(id) != in_flight.end());
+   Pending& sent = in_flight[id];
+   sent = pending;
+   Send(id, sent);
+   return true;
+}
+
+void DnsClient::Send(unsigned short id, Pending& pending) {
+   const Server& server = servers[pending.tries % servers.size()];
+   pending.tries++;
+   pending.deadline = Utils::MonotonicMs() + timeout * 1000;
+
+   // header: id, recursion desired, one question
+   unsigned char header[12] = {static_cast<unsigned char>(id >> 8), static_cast<unsigned char>(id & 0xff),
+                               0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+   query.assign(header, header + sizeof header);
+   string::size_type start = 0;
+   while (start < pending.qname.size()) {
+      string::size_type dot = pending.qname.find('.', start);
+      if (dot == string::npos) dot = pending.qname.size();
+      query.push_back(static_cast<unsigned char>(dot - start));
+      query.insert(query.end(), pending.qname.begin() + start, pending.qname.begin() + dot);
+      start = dot + 1;
+   }
+   query.push_back(0);
+   unsigned char question[4] = {0, DNS_TYPE_PTR, 0, DNS_CLASS_IN};
+   query.insert(query.end(), question, question + sizeof question);
+
+   int fd = SendSocket(server.socket);
+   socket_users[fd]++;
+   Release(pending.fd);
+   pending.fd = fd;
+   if (sendto(fd, &query[0], query.size(), 0,
+              reinterpret_cast<const struct sockaddr*>(&server.addr), server.addr_len) < 0) {
+      // e.g. network is unreachable, next server is tried right away
+      pending.deadline = 0;
+   }
+}
+
+void DnsClient::Retry(map<unsigned short, Pending>::iterator it, vector<Answer>& answers) {
+   if (it->second.tries >= attempts * static_cast<int>(servers.size())) {
+      answers.push_back(Answer(it->second.ip));
+      Release(it->second.fd);
+      in_flight.erase(it);
+   } else {
+      Send(it->first, it->second);
+   }
+}
+
+void DnsClient::Wait(int wake_fd, vector<Answer>& answers) {
+   long long now = Utils::MonotonicMs();
+   int wait_ms = -1;
+   if (!answers.empty()) {
+      wait_ms = 0;
+   } else {
+      for (map<unsigned short, Pending>::iterator it = in_flight.begin(); it != in_flight.end(); ++it) {
+         int left = static_cast<int>(std::max(it->second.deadline - now, 0LL));
+         if ((wait_ms < 0) || (left < wait_ms)) wait_ms = left;
+      }
+   }
+
+   struct pollfd pfd;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+   fds.clear();
+   if (wake_fd >= 0) {
+      pfd.fd = wake_fd;
+      fds.push_back(pfd);
+   }
+   size_t first_socket = fds.size();
+   for (int i = 0; i < 2; ++i) {
+      if (sockets[i] < 0) continue;
+      pfd.fd = sockets[i];
+      fds.push_back(pfd);
+   }
+   // replaced sockets still waiting for answers
+   for (map<int, int>::iterator it = socket_users.begin(); it != socket_users.end(); ++it) {
+      if ((it->first == sockets[0]) || (it->first == sockets[1])) continue;
+      pfd.fd = it->first;
+      fds.push_back(pfd);
+   }
+   if (poll(&fds[0], fds.size(), wait_ms) > 0) {
+      // Receive may close replaced socket, but only after reading from it
+      for (size_t i = first_socket; i < fds.size(); ++i) {
+         if (fds[i].revents & POLLIN) Receive(fds[i].fd, answers);
+      }
+   }
+
+   now = Utils::MonotonicMs();
+   for (map<unsigned short, Pending>::iterator it = in_flight.begin(); it != in_flight.end(); ) {
+      // Retry may erase it
+      map<unsigned short, Pending>::iterator current = it++;
+      if (current->second.deadline <= now) Retry(current, answers);
+   }
+}
+
+void DnsClient::Receive(int socket, vector<Answer>& answers) {
+   buf.resize(DNS_MAX_PACKET);
+   while (true) {
+      struct sockaddr_storage from;
+      socklen_t from_len = sizeof from;
+      ssize_t len = recvfrom(socket, &buf[0], buf.size(), 0, reinterpret_cast<struct sockaddr*>(&from), &from_len);
+      if (len < 0) break;
+      Parse(socket, &buf[0], len, from, answers);
+   }
+}
+
+static bool SameAddr(const struct sockaddr_storage& a, const struct sockaddr_storage& b) {
+   if (a.ss_family != b.ss_family) return false;
+   if (a.ss_family == AF_INET) {
+      const struct sockaddr_in* a4 = reinterpret_cast<const struct sockaddr_in*>(&a);
+      const struct sockaddr_in* b4 = reinterpret_cast<const struct sockaddr_in*>(&b);
+      return (a4->sin_port == b4->sin_port) && (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+   }
+   const struct sockaddr_in6* a6 = reinterpret_cast<const struct sockaddr_in6*>(&a);
+   const struct sockaddr_in6* b6 = reinterpret_cast<const struct sockaddr_in6*>(&b);
+   return (a6->sin6_port == b6->sin6_port) && (memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof a6->sin6_addr) == 0);
+}
+
+void DnsClient::Parse(int socket, const unsigned char* packet, size_t len, const struct sockaddr_storage& from,
+                      vector<Answer>& answers) {
+   if (len < 12) return;
+   map<unsigned short, Pending>::iterator it = in_flight.find((packet[0] << 8) | packet[1]);
+   if (it == in_flight.end()) return;
+   Pending& pending = it->second;
+   // answer has to come from server last query was sent to, to the port it was sent from, for the same question
+   if ((socket != pending.fd) || !SameAddr(from, servers[(pending.tries - 1) % servers.size()].addr)) return;
+   bool response = packet[2] & 0x80;
+   bool truncated = packet[2] & 0x02;
+   int rcode = packet[3] & 0x0f;
+   int questions = (packet[4] << 8) | packet[5];
+   int records = (packet[6] << 8) | packet[7];
+   if (!response || (questions != 1)) return;
+   string name;
+   size_t pos = ReadName(packet, len, 12, name);
+   if ((pos == 0) || (pos + 4 > len)) return;
+   Utils::ToLower(name);
+   if ((name != pending.qname) || (((packet[pos] << 8) | packet[pos + 1]) != DNS_TYPE_PTR) ||
+       (((packet[pos + 2] << 8) | packet[pos + 3]) != DNS_CLASS_IN)) return;
+   pos += 4;
+
+   // SERVFAIL, REFUSED and alike are problems of server, not of address
+   if (truncated || ((rcode != 0) && (rcode != DNS_RCODE_NXDOMAIN))) {
+      Retry(it, answers);
+      return;
+   }
+   Answer answer(pending.ip);
+   vector<DnsRecord> section;
+   for (int i = 0; (rcode == 0) && (i < records); ++i) {
+      DnsRecord record;
+      pos = ReadName(packet, len, pos, record.owner);
+      if ((pos == 0) || (pos + 10 > len)) break;
+      Utils::ToLower(record.owner);
+      record.type = (packet[pos] << 8) | packet[pos + 1];
+      int rclass = (packet[pos + 2] << 8) | packet[pos + 3];
+      record.ttl = (static_cast<long>(packet[pos + 4]) << 24) | (packet[pos + 5] << 16) |
+                   (packet[pos + 6] << 8) | packet[pos + 7];
+      size_t rdlength = (packet[pos + 8] << 8) | packet[pos + 9];
+      pos += 10;
+      if (pos + rdlength > len) break;
+      record.rdata = pos;
+      pos += rdlength;
+      if (rclass == DNS_CLASS_IN) section.push_back(record);
+   }
+   // only PTR of question name counts, or of target of CNAME chain starting at it (RFC 2317
+   // delegation); records of other names (e.g. spoofed ones) are ignored, ttl is the smallest of chain
+   string target = pending.qname;
+   long ttl = -1;
+   for (int hops = 0; (hops <= DNS_MAX_CNAMES) && !answer.found; ++hops) {
+      vector<DnsRecord>::iterator record = section.begin();
+      while ((record != section.end()) && ((record->owner != target) ||
+             ((record->type != DNS_TYPE_PTR) && (record->type != DNS_TYPE_CNAME))))
+         ++record;
+      if (record == section.end()) break;
+      if ((ttl < 0) || (record->ttl < ttl)) ttl = record->ttl;
+      if (record->type == DNS_TYPE_PTR) {
+         answer.found = (ReadName(packet, len, record->rdata, answer.name) != 0) && !answer.name.empty();
+         break;
+      }
+      if (ReadName(packet, len, record->rdata, target) == 0) break;
+      Utils::ToLower(target);
+   }
+   if (answer.found) answer.ttl = ttl;
+   answers.push_back(answer);
+   Release(pending.fd);
+   in_flight.erase(it);
+}
+
+/* static */ size_t DnsClient::ReadName(const unsigned char* packet, size_t len, size_t pos, string& name) {
+   name.clear();
+   size_t end = 0;
+   int jumps = 0;
+   while (pos < len) {
+      unsigned char label = packet[pos];
+      if ((label & 0xc0) == 0xc0) {
+         if ((pos + 1 >= len) || (++jumps > 32)) return 0;
+         if (end == 0) end = pos + 2;
+         pos = ((label & 0x3f) << 8) | packet[pos + 1];
+      } else if (label & 0xc0) {
+         return 0;
+      } else if (label == 0) {
+         return (end == 0) ? pos + 1 : end;
+      } else {
+         if (pos + 1 + label > len) return 0;
+         if (!name.empty()) name += '.';
+         name.append(reinterpret_cast<const char*>(packet) + pos + 1, label);
+         if (name.size() > 255) return 0;
+         pos += 1 + label;
+      }
+   }
+   return 0;
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
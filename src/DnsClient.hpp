@@ -0,0 +1,131 @@
+/*
+ * (C) 2011 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __DNSCLIENT_H
+#define __DNSCLIENT_H
+
+#include <string>
+#include <vector>
+#include <map>
+//uint32_t
+#include <stdint.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+// defaults of resolv.conf "options timeout:n attempts:n"
+#define DNS_TIMEOUT 5
+#define DNS_ATTEMPTS 2
+// resolv.conf may list more, but resolver(3) uses only first ones
+#define DNS_MAX_SERVERS 3
+// queries waiting for answers at the same time
+#define DNS_MAX_IN_FLIGHT 256
+// queries sent from one source port, then socket is replaced by new one
+#define DNS_SOCKET_QUERIES 64
+
+// Non-blocking stub resolver for PTR queries: many queries in flight over one UDP socket
+// per address family, answers are matched by id and question. Query that timed out or got
+// SERVFAIL is sent again to next nameserver, up to attempts times for each of them.
+// Against spoofed answers it has random ids (from /dev/urandom) and source ports (socket is
+// replaced every DNS_SOCKET_QUERIES queries), answer must come from the server and to the socket
+// query was sent from. No 0x20 or DNSSEC, so off-path attacker still may win with enough packets.
+// Not thread safe, meant to be driven by one thread:
+//////
+// DnsClient dns;
+// if (dns.Open()) {
+//    dns.Query("192.168.0.1");
+//    std::vector<DnsClient::Answer> answers;
+//    while (dns.InFlight() > 0) dns.Wait(-1, answers);
+// }
+//////
+class DnsClient {
+   public:
+      struct Answer {
+         std::string ip;
+         // ip has name (false if there is none or all nameservers failed)
+         bool found;
+         std::string name;
+         // seconds, smallest of records leading to name
+         long ttl;
+         Answer(const std::string& ip) : ip(ip), found(false), ttl(0) {};
+      };
+
+      DnsClient();
+      ~DnsClient();
+
+      // takes nameservers, timeout and attempts from resolv.conf, false if it has no usable nameservers
+      bool Open(const std::string& resolv_conf = DNS_RESOLV_CONF);
+      // false if addr is not an address or socket for it can't be opened
+      bool AddServer(const std::string& addr, int port = 53);
+      size_t Servers() const { return servers.size(); }
+
+      // sends PTR query for IPv4 or IPv6 address, false if ip is not one
+      bool Query(const std::string& ip);
+      size_t InFlight() const { return in_flight.size(); }
+      // waits until answer comes, some query times out or wake_fd (if not -1) becomes readable;
+      // adds answers and queries given up on to answers, does not wait if answers is not empty
+      void Wait(int wake_fd, std::vector<Answer>& answers);
+
+   private:
+      struct Server {
+         struct sockaddr_storage addr;
+         socklen_t addr_len;
+         // index in sockets
+         int socket;
+      };
+      struct Pending {
+         std::string ip;
+         // reversed ip under in-addr.arpa or ip6.arpa
+         std::string qname;
+         // sent so far, next one goes to servers[tries % servers.size()]
+         int tries;
+         long long deadline;
+         // socket last try was sent from, -1 before first one
+         int fd;
+      };
+
+      void Send(unsigned short id, Pending& pending);
+      // query failed on its server, sends it to next one or gives up on it
+      void Retry(std::map<unsigned short, Pending>::iterator it, std::vector<Answer>& answers);
+      // socket of family index to send next query from, replaces it once it sent DNS_SOCKET_QUERIES
+      int SendSocket(int index);
+      // query sent from fd is answered or given up on, closes replaced socket nobody waits on
+      void Release(int fd);
+      void Receive(int socket, std::vector<Answer>& answers);
+      void Parse(int socket, const unsigned char* packet, size_t len, const struct sockaddr_storage& from,
+                 std::vector<Answer>& answers);
+      // reads (possibly compressed) name at pos, returns position after it or 0 if it is broken
+      static size_t ReadName(const unsigned char* packet, size_t len, size_t pos, std::string& name);
+      static bool ReverseName(const std::string& ip, std::string& qname);
+      static int OpenSocket(int family);
+      unsigned short NextId();
+
+      std::vector<Server> servers;
+      // one per family: AF_INET, AF_INET6, -1 if not opened
+      int sockets[2];
+      // queries sent from each of sockets
+      int socket_sent[2];
+      // fd => queries in flight sent from it, replaced sockets are kept until it drops to zero
+      std::map<int, int> socket_users;
+      // seconds
+      int timeout;
+      int attempts;
+      std::map<unsigned short, Pending> in_flight;
+      // /dev/urandom, -1 if it can't be opened
+      int random_fd;
+      // bytes read from random_fd ahead, ids are taken from them
+      std::vector<unsigned char> random;
+      size_t random_pos;
+      // state of xorshift generator of ids, used only if random_fd can't be read
+      uint32_t id_state;
+      // reused buffers for sent and received packets
+      std::vector<unsigned char> query;
+      std::vector<unsigned char> buf;
+      std::vector<struct pollfd> fds;
+};
+
+#endif /* __DNSCLIENT_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
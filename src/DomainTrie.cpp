@@ -0,0 +1,111 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+//sort, max
+#include <algorithm>
+
+#include "DomainTrie.hpp"
+
+using std::string;
+using std::vector;
+using Utils::IPAddr;
+using Utils::StrRef;
+
+namespace sqtop {
+
+void DomainTotals::Add(const DomainTotals& other) {
+   requests += other.requests;
+   size += other.size;
+   av_speed += other.av_speed;
+   curr_speed += other.curr_speed;
+   max_etime = std::max(max_etime, other.max_etime);
+}
+
+DomainTrie::DomainTrie(StringPool& names) : names(names) {
+   nodes.push_back(Node(Atom(), 0, -1));
+}
+
+uint32_t DomainTrie::Insert(StrRef host) {
+   for (size_t i = 0; i < host.len; ++i) {
+      if ((host.data[i] >= 'A') && (host.data[i] <= 'Z')) {
+         lowered.assign(host.data, host.len);
+         Utils::ToLower(lowered);
+         host = StrRef(lowered.data(), lowered.size());
+         break;
+      }
+   }
+   if (host.empty())
+      host = StrRef("-", 1);
+
+   Atom name = names.Intern(host.data, host.len);
+   uint32_t* pNode = index.Find(&name.str());
+   if (pNode != NULL) return *pNode;
+
+   // parent is domain after first label, addresses have none
+   uint32_t parent = 0;
+   const char* dot = static_cast<const char*>(memchr(host.data, '.', host.len));
+   IPAddr addr;
+   if ((dot != NULL) && (dot + 1 != host.data + host.len) && !Utils::ParseIP(host, addr))
+      parent = Insert(StrRef(dot + 1, host.data + host.len - dot - 1));
+
+   uint32_t node = nodes.size();
+   nodes.push_back(Node(name, parent, nodes[parent].depth + 1));
+   nodes[parent].children.push_back(node);
+   *index.Insert(&name.str()) = node;
+   return node;
+}
+
+void DomainTrie::AddRequest(uint32_t node, const DomainTotals& request, uint32_t client, Atom username) {
+   nodes[node].own_requests++;
+   nodes[node].totals.Add(request);
+   // clients come one by one, so domain has client already if it is the last one added
+   // to it, and then all its parents have it too
+   for (uint32_t n = node; n != 0; n = nodes[n].parent) {
+      if (!nodes[n].clients.empty() && (nodes[n].clients.back() == client)) break;
+      nodes[n].clients.push_back(client);
+   }
+   if (username.empty()) return;
+   for (uint32_t n = node; n != 0; n = nodes[n].parent) {
+      if (!nodes[n].usernames.insert(username).second) break;
+   }
+}
+
+void DomainTrie::Aggregate() {
+   // children have bigger indexes than parents, so going back sums every subtree before its root
+   for (size_t node = nodes.size() - 1; node > 0; --node)
+      nodes[nodes[node].parent].totals.Add(nodes[node].totals);
+}
+
+// bigger domains first, equal ones by name
+struct BySize {
+   const vector<DomainTrie::Node>& nodes;
+   BySize(const vector<DomainTrie::Node>& nodes) : nodes(nodes) {};
+   bool operator () (uint32_t a, uint32_t b) const {
+      if (nodes[a].totals.size != nodes[b].totals.size)
+         return nodes[a].totals.size > nodes[b].totals.size;
+      return nodes[a].name.str() < nodes[b].name.str();
+   }
+};
+
+vector<uint32_t> DomainTrie::Order() const {
+   vector<uint32_t> result;
+   result.reserve(nodes.size() - 1);
+   // depth first, children are pushed in reverse so the biggest one is taken first
+   vector<uint32_t> stack(1, 0);
+   vector<uint32_t> children;
+   while (!stack.empty()) {
+      uint32_t node = stack.back();
+      stack.pop_back();
+      if (node != 0) result.push_back(node);
+      children = nodes[node].children;
+      std::sort(children.begin(), children.end(), BySize(nodes));
+      stack.insert(stack.end(), children.rbegin(), children.rend());
+   }
+   return result;
+}
+
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,87 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __DOMAINTRIE_H
+#define __DOMAINTRIE_H
+
+#include <string>
+#include <vector>
+#include <set>
+//uint32_t
+#include <stdint.h>
+
+#include "Utils.hpp"
+#include "StringPool.hpp"
+#include "FlatHash.hpp"
+
+namespace sqtop {
+
+// sums over requests to a domain and its subdomains
+struct DomainTotals {
+   size_t requests;
+   long long size;
+   long av_speed;
+   long curr_speed;
+   long max_etime;
+   DomainTotals() : requests(0), size(0), av_speed(0), curr_speed(0), max_etime(0) {};
+   void Add(const DomainTotals& other);
+};
+
+// Trie of destination domains with labels in reverse order: "com" is parent of "example.com",
+// which is parent of "cdn.example.com". Hosts given by address (http://10.0.0.1/) are on top level.
+// Requests are added to node of their host and summed into its parent domains by Aggregate.
+class DomainTrie {
+   public:
+      struct Node {
+         // full name of domain ("example.com"), interned in pool of trie
+         Atom name;
+         // root (node 0) for top level domains
+         uint32_t parent;
+         // 0 for top level domains
+         int depth;
+         // requests to exactly this host
+         size_t own_requests;
+         // of own requests, and after Aggregate of all requests to subdomains as well
+         DomainTotals totals;
+         // numbers of clients (in ascending order) and users of all requests to domain and its subdomains
+         std::vector<uint32_t> clients;
+         std::set<Atom> usernames;
+         std::vector<uint32_t> children;
+         Node(Atom name, uint32_t parent, int depth) : name(name), parent(parent), depth(depth), own_requests(0) {};
+      };
+
+      // names of domains are interned in names
+      explicit DomainTrie(StringPool& names);
+
+      // node of host (in any case), created with nodes of its parent domains if needed
+      uint32_t Insert(Utils::StrRef host);
+      // request to host of node made by client, client and user are added to all parent domains;
+      // all requests of client have to be added one after another, clients in ascending order
+      void AddRequest(uint32_t node, const DomainTotals& request, uint32_t client, Atom username);
+      // sums totals bottom-up, must be called once, after last AddRequest
+      void Aggregate();
+      // all nodes but root in tree order: every domain is followed by its subdomains,
+      // subdomains of the same domain are ordered by size
+      std::vector<uint32_t> Order() const;
+
+      // number of nodes including root
+      size_t Size() const { return nodes.size(); }
+      Node& operator [] (uint32_t node) { return nodes[node]; }
+
+   private:
+      StringPool& names;
+      // parents are always created before children, so every child has bigger index
+      std::vector<Node> nodes;
+      // name (string of atom) -> node
+      FlatHash<const std::string*, uint32_t, PointerHash> index;
+      // reused buffer for lowercasing hosts
+      std::string lowered;
+};
+
+}
+
+#endif /* __DOMAINTRIE_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
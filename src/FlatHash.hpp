@@ -0,0 +1,150 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __FLATHASH_H
+#define __FLATHASH_H
+
+#include <vector>
+#include <cstddef>
+//uint64_t, uintptr_t
+#include <stdint.h>
+
+namespace sqtop {
+
+// Open addressing hash table with linear probing, all slots in one vector.
+// Hash is a functor returning size_t for Key.
+// Pointers returned by Find/Insert are valid until next Insert.
+template <typename Key, typename Value, typename Hash>
+class FlatHash {
+   public:
+      FlatHash() : slots(FLATHASH_MIN_SLOTS), count(0) {};
+
+      Value* Find(const Key& key) {
+         size_t slot = Slot(key);
+         return slots[slot].used ? &slots[slot].value : NULL;
+      }
+
+      // existing value for key or new default value
+      Value* Insert(const Key& key, bool* pInserted = NULL) {
+         // keep load factor under 1/2
+         if ((count + 1) * 2 > slots.size())
+            Rehash(slots.size() * 2);
+         size_t slot = Slot(key);
+         bool inserted = !slots[slot].used;
+         if (inserted) {
+            slots[slot].used = true;
+            slots[slot].key = key;
+            slots[slot].value = Value();
+            count++;
+         }
+         if (pInserted != NULL) *pInserted = inserted;
+         return &slots[slot].value;
+      }
+
+      bool Erase(const Key& key) {
+         size_t slot = Slot(key);
+         if (!slots[slot].used) return false;
+         EraseSlot(slot);
+         return true;
+      }
+
+      // removes all values, keeps allocated slots
+      void Clear() {
+         for (size_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].used) {
+               slots[i].used = false;
+               slots[i].value = Value();
+            }
+         }
+         count = 0;
+      }
+
+      // shrinks table if it is mostly empty, e.g. after peak load
+      void Compact() {
+         size_t size = FLATHASH_MIN_SLOTS;
+         while (size < count * 4) size *= 2;
+         if (size * 2 <= slots.size())
+            Rehash(size);
+      }
+
+      size_t Size() const { return count; }
+
+      // iteration over slots: for (i = 0; i < Capacity(); ++i) if (Used(i)) ...
+      size_t Capacity() const { return slots.size(); }
+      bool Used(size_t slot) const { return slots[slot].used; }
+      const Key& KeyAt(size_t slot) const { return slots[slot].key; }
+      Value& ValueAt(size_t slot) { return slots[slot].value; }
+
+      // removes value in slot; slot may then hold another value, so iterating code
+      // has to check it again before moving to next one
+      void EraseSlot(size_t slot) {
+         size_t mask = slots.size() - 1;
+         slots[slot].used = false;
+         slots[slot].value = Value();
+         count--;
+         // backward shift deletion: move following entries into the hole
+         size_t hole = slot;
+         for (size_t next = (hole + 1) & mask; slots[next].used; next = (next + 1) & mask) {
+            size_t home = hasher(slots[next].key) & mask;
+            // entry may move to hole only if hole is between its home and current slot
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+               slots[hole] = slots[next];
+               slots[next].used = false;
+               slots[next].value = Value();
+               hole = next;
+            }
+         }
+      }
+
+   private:
+      // must be power of 2
+      enum { FLATHASH_MIN_SLOTS = 16 };
+
+      struct Entry {
+         Key key;
+         Value value;
+         bool used;
+         Entry() : key(), value(), used(false) {};
+      };
+
+      // slot holding key or empty slot where it belongs
+      size_t Slot(const Key& key) const {
+         size_t mask = slots.size() - 1;
+         size_t slot = hasher(key) & mask;
+         while (slots[slot].used && !(slots[slot].key == key))
+            slot = (slot + 1) & mask;
+         return slot;
+      }
+
+      void Rehash(size_t size) {
+         std::vector<Entry> old(size);
+         old.swap(slots);
+         for (size_t i = 0; i < old.size(); ++i) {
+            if (old[i].used)
+               slots[Slot(old[i].key)] = old[i];
+         }
+      }
+
+      std::vector<Entry> slots;
+      size_t count;
+      Hash hasher;
+};
+
+// hash for pointers (e.g. to strings of atoms)
+struct PointerHash {
+   size_t operator () (const void* p) const {
+      uint64_t h = reinterpret_cast<uintptr_t>(p);
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      return static_cast<size_t>(h);
+   }
+};
+
+}
+
+#endif /* __FLATHASH_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,323 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+//sort, unique, max
+#include <algorithm>
+#include <map>
+
+#include "Pivot.hpp"
+#include "Utils.hpp"
+#include "SubnetTrie.hpp"
+#include "DomainTrie.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+using sqtop::Options;
+using sqtop::Atom;
+using sqtop::SquidStats;
+using sqtop::SquidConnection;
+using sqtop::StatColumns;
+using sqtop::StringPool;
+using sqtop::StringPoolRef;
+using sqtop::FlatHash;
+using sqtop::PointerHash;
+using sqtop::RequestIdHash;
+using sqtop::SubnetTrie;
+using sqtop::SubnetTotals;
+using sqtop::DomainTrie;
+using sqtop::DomainTotals;
+using Utils::IPAddr;
+using Utils::StrRef;
+
+namespace Pivot {
+
+// group of each request by username, names of groups in alphabetical order
+static void UserGroups(const StatColumns& stats, bool strip_user_domain, vector<uint32_t>& group, vector<string>& names) {
+   // usernames are atoms, so every distinct one is stripped and looked up by name only once
+   FlatHash<const string*, uint32_t, PointerHash> by_atom;
+   map<string, uint32_t> by_name;
+   for (size_t row = 0; row < stats.Size(); ++row) {
+      bool inserted;
+      uint32_t* pGroup = by_atom.Insert(&stats.username[row].str(), &inserted);
+      if (inserted) {
+         string name = stats.username[row];
+         if (name.empty())
+            name = "-";
+         else if (strip_user_domain)
+            name = Utils::StripUserDomain(name);
+         *pGroup = by_name.insert(std::make_pair(name, by_name.size())).first->second;
+      }
+      group[row] = *pGroup;
+   }
+
+   // map is ordered by name, renumber groups in that order
+   vector<uint32_t> rank(by_name.size());
+   names.clear();
+   for (map<string, uint32_t>::iterator it = by_name.begin(); it != by_name.end(); ++it) {
+      rank[it->second] = names.size();
+      names.push_back(it->first);
+   }
+   for (size_t row = 0; row < group.size(); ++row)
+      group[row] = rank[group[row]];
+}
+
+// group of each request by delay pool, names of groups in order of pool numbers
+static void PoolGroups(const StatColumns& stats, vector<uint32_t>& group, vector<string>& names) {
+   FlatHash<uint64_t, uint32_t, RequestIdHash> by_pool;
+   vector<int> pools;
+   for (size_t row = 0; row < stats.Size(); ++row) {
+      bool inserted;
+      uint32_t* pGroup = by_pool.Insert(static_cast<uint32_t>(stats.delay_pool[row]), &inserted);
+      if (inserted) {
+         *pGroup = pools.size();
+         pools.push_back(stats.delay_pool[row]);
+      }
+      group[row] = *pGroup;
+   }
+
+   vector<int> sorted(pools);
+   std::sort(sorted.begin(), sorted.end());
+   vector<uint32_t> rank(pools.size());
+   for (size_t i = 0; i < pools.size(); ++i)
+      rank[i] = std::lower_bound(sorted.begin(), sorted.end(), pools[i]) - sorted.begin();
+   names.clear();
+   for (vector<int>::iterator it = sorted.begin(); it != sorted.end(); ++it)
+      names.push_back(Utils::itos(*it));
+   for (size_t row = 0; row < group.size(); ++row)
+      group[row] = rank[group[row]];
+}
+
+// prefix lengths of subnet levels
+static const int v4_levels[SUBNET_LEVELS] = { 16, 24 };
+static const int v6_levels[SUBNET_LEVELS] = { 48, 64 };
+
+// every subnet of hosts of in followed by its subnets and hosts, totals of subnets are summed in trie
+static void Subnets(const SquidStats& in, SquidStats& out) {
+   SubnetTrie trie;
+   for (vector<SquidConnection>::const_iterator it = in.connections.begin(); it != in.connections.end(); ++it) {
+      SubnetTotals totals;
+      totals.hosts = 1;
+      totals.requests = it->stats_count;
+      totals.size = it->sum_size;
+      totals.av_speed = it->av_speed;
+      totals.curr_speed = it->curr_speed;
+      totals.max_etime = it->max_etime;
+      trie.AddHost(it->addr, totals);
+   }
+   trie.Aggregate();
+
+   // hosts keep their requests, subnets refer to requests of all their hosts
+   out.stats = in.stats;
+   // subnet of each level last host belongs to, as network and index in out.connections
+   IPAddr networks[SUBNET_LEVELS];
+   size_t subnets[SUBNET_LEVELS];
+   for (size_t i = 0; i < in.connections.size(); ++i) {
+      const SquidConnection& host = in.connections[i];
+      const int* levels = host.addr.IsV4() ? v4_levels : v6_levels;
+      // hosts are in address order, so new subnet starts when network of host changes
+      bool changed = (i == 0);
+      for (int level = 0; level < SUBNET_LEVELS; ++level) {
+         IPAddr network = SubnetTrie::Network(host.addr, levels[level]);
+         changed = changed || !(network == networks[level]);
+         if (!changed) continue;
+         SubnetTotals totals = trie.Totals(network, levels[level]);
+         SquidConnection subnet;
+         string name = Utils::FormatIP(network) + "/" + Utils::itos(levels[level]);
+         subnet.peer = out.group_names->Intern(name);
+#ifdef WITH_RESOLVER
+         subnet.hostname = name;
+#endif
+         subnet.addr = network;
+         subnet.depth = level;
+         // no requests of its own
+         subnet.first_stat = host.first_stat;
+         subnet.tree_count = totals.requests;
+         subnet.sum_size = totals.size;
+         subnet.av_speed = totals.av_speed;
+         subnet.curr_speed = totals.curr_speed;
+         subnet.max_etime = totals.max_etime;
+         networks[level] = network;
+         subnets[level] = out.connections.size();
+         out.connections.push_back(subnet);
+      }
+      for (int level = 0; level < SUBNET_LEVELS; ++level) {
+         SquidConnection& subnet = out.connections[subnets[level]];
+         // hosts are in address order
+         subnet.peers.push_back(host.addr);
+         subnet.usernames.insert(host.usernames.begin(), host.usernames.end());
+      }
+      out.connections.push_back(host);
+      out.connections.back().depth = SUBNET_LEVELS;
+      out.connections.back().tree_count = host.stats_count;
+      // rows keep their order, but host has new place among subnets
+      for (size_t row = host.first_stat; row < host.first_stat + host.stats_count; ++row)
+         out.stats.conn[row] = out.connections.size() - 1;
+   }
+}
+
+// every destination domain followed by its subdomains, requests are rows of domain of their host
+static void Domains(const SquidStats& in, SquidStats& out) {
+   DomainTrie trie(*out.group_names.get());
+   size_t rows = in.stats.Size();
+   vector<uint32_t> node(rows);
+   // urls are atoms, so host of every distinct one is extracted and looked up only once
+   FlatHash<const string*, uint32_t, PointerHash> by_url;
+   // requests are added client by client, in address order of clients
+   for (size_t client = 0; client < in.connections.size(); ++client) {
+      const SquidConnection& host = in.connections[client];
+      size_t end = host.first_stat + host.stats_count;
+      for (size_t row = host.first_stat; row < end; ++row) {
+         bool inserted;
+         uint32_t* pNode = by_url.Insert(&in.stats.uri[row].str(), &inserted);
+         if (inserted) {
+            const string& url = in.stats.uri[row];
+            *pNode = trie.Insert(Utils::UrlHost(StrRef(url.data(), url.size())));
+         }
+         node[row] = *pNode;
+         DomainTotals request;
+         request.requests = 1;
+         request.size = in.stats.size[row];
+         request.av_speed = in.stats.av_speed[row];
+         request.curr_speed = in.stats.curr_speed[row];
+         request.max_etime = in.stats.etime[row];
+         trie.AddRequest(node[row], request, client, in.stats.username[row]);
+      }
+   }
+   trie.Aggregate();
+
+   // row of every domain in out.connections
+   vector<uint32_t> order = trie.Order();
+   vector<uint32_t> position(trie.Size());
+   for (size_t i = 0; i < order.size(); ++i)
+      position[order[i]] = i;
+
+   // counting sort by position of domain: requests of domain and all its subdomains follow each other
+   out.connections.resize(order.size());
+   vector<uint32_t> next(order.size());
+   size_t first = 0;
+   for (size_t i = 0; i < order.size(); ++i) {
+      out.connections[i].first_stat = first;
+      next[i] = first;
+      first += trie[order[i]].own_requests;
+   }
+   vector<uint32_t> place(rows);
+   for (size_t row = 0; row < rows; ++row)
+      place[row] = next[position[node[row]]]++;
+   out.stats.Scatter(in.stats, place);
+   for (size_t row = 0; row < rows; ++row)
+      out.stats.conn[place[row]] = position[node[row]];
+
+   for (size_t i = 0; i < order.size(); ++i) {
+      DomainTrie::Node& domain = trie[order[i]];
+      SquidConnection& conn = out.connections[i];
+      conn.peer = domain.name;
+#ifdef WITH_RESOLVER
+      conn.hostname = domain.name;
+#endif
+      conn.depth = domain.depth;
+      conn.stats_count = domain.own_requests;
+      conn.tree_count = domain.totals.requests;
+      conn.sum_size = domain.totals.size;
+      conn.av_speed = domain.totals.av_speed;
+      conn.curr_speed = domain.totals.curr_speed;
+      conn.max_etime = domain.totals.max_etime;
+      // clients are numbered in address order
+      conn.peers.reserve(domain.clients.size());
+      for (vector<uint32_t>::iterator it = domain.clients.begin(); it != domain.clients.end(); ++it)
+         conn.peers.push_back(in.connections[*it].addr);
+      conn.usernames.swap(domain.usernames);
+      // every domain has requests, so it has clients too
+      conn.addr = *conn.peers.begin();
+   }
+}
+
+void Group(const SquidStats& in, Options::GROUP_BY by, bool strip_user_domain, SquidStats& out) {
+   if (by == Options::GROUP_HOST) {
+      out = in;
+      return;
+   }
+
+   out.connections.clear();
+   out.stats.Clear();
+   out.generation = in.generation;
+   out.group_by = by;
+   out.strings = in.strings;
+   out.group_names = StringPoolRef(new StringPool());
+   out.stamp = in.stamp;
+   out.av_speed = in.av_speed;
+   out.curr_speed = in.curr_speed;
+   out.total_connections = in.total_connections;
+   if (by == Options::GROUP_SUBNET) {
+      Subnets(in, out);
+      return;
+   }
+   if (by == Options::GROUP_DOMAIN) {
+      Domains(in, out);
+      return;
+   }
+
+   size_t rows = in.stats.Size();
+   vector<uint32_t> group(rows);
+   vector<string> names;
+   if (by == Options::GROUP_USER)
+      UserGroups(in.stats, strip_user_domain, group, names);
+   else
+      PoolGroups(in.stats, group, names);
+
+   out.connections.resize(names.size());
+
+   // counting sort: requests of every group follow each other, in order they had in in
+   for (size_t row = 0; row < rows; ++row)
+      out.connections[group[row]].stats_count++;
+   vector<uint32_t> next(names.size());
+   size_t first = 0;
+   for (size_t g = 0; g < names.size(); ++g) {
+      out.connections[g].first_stat = first;
+      next[g] = first;
+      first += out.connections[g].stats_count;
+   }
+   vector<uint32_t> place(rows);
+   for (size_t row = 0; row < rows; ++row)
+      place[row] = next[group[row]]++;
+   out.stats.Scatter(in.stats, place);
+
+   for (size_t g = 0; g < names.size(); ++g) {
+      SquidConnection& conn = out.connections[g];
+      conn.peer = out.group_names->Intern(names[g]);
+#ifdef WITH_RESOLVER
+      conn.hostname = names[g];
+#endif
+      size_t end = conn.first_stat + conn.stats_count;
+      uint32_t last_host = UINT32_MAX;
+      Atom last_user;
+      for (size_t row = conn.first_stat; row < end; ++row) {
+         // requests of a host follow each other, so clients are added once per host
+         if (out.stats.conn[row] != last_host) {
+            last_host = out.stats.conn[row];
+            conn.peers.push_back(in.connections[last_host].addr);
+         }
+         if (!out.stats.username[row].empty() && (out.stats.username[row] != last_user)) {
+            last_user = out.stats.username[row];
+            conn.usernames.insert(last_user);
+         }
+         out.stats.conn[row] = g;
+
+         conn.sum_size += out.stats.size[row];
+         conn.av_speed += out.stats.av_speed[row];
+         // there is no meter per group, so current speed is that of its requests
+         conn.curr_speed += out.stats.curr_speed[row];
+         conn.max_etime = std::max(conn.max_etime, out.stats.etime[row]);
+      }
+      std::sort(conn.peers.begin(), conn.peers.end());
+      conn.peers.erase(std::unique(conn.peers.begin(), conn.peers.end()), conn.peers.end());
+      // group is ordered by lowest address of its clients
+      conn.addr = conn.peers.front();
+   }
+}
+
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,31 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __PIVOT_H
+#define __PIVOT_H
+
+#include "options.hpp"
+#include "sqstat.hpp"
+
+// levels of subnets in subnet view (/16 and /24 for IPv4, /48 and /64 for IPv6),
+// hosts are one level deeper
+#define SUBNET_LEVELS 2
+
+// Views of snapshot with requests grouped by user, delay pool, subnet or domain instead of client host.
+// Requests are assigned to groups in one pass through hash table and laid out as connections
+// of new snapshot, so everything that shows, sorts or compacts hosts works on groups as well.
+// Subnet view is a tree: every subnet is followed by its subnets and hosts (with SquidConnection::depth
+// set), it keeps address order and subnets have no requests of their own.
+// Domain view is a tree of destination domains: every domain is followed by its subdomains (biggest first),
+// each has requests to exactly its host, and clients (peers) and totals of all requests below it.
+namespace Pivot {
+   // connections of out are groups of requests of in (ordered by name or address), each request
+   // keeps its client in UriStats::peer; out shares strings with in, totals of in are copied
+   extern void Group(const sqtop::SquidStats& in, sqtop::Options::GROUP_BY by, bool strip_user_domain, sqtop::SquidStats& out);
+};
+
+#endif /* __PIVOT_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,78 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+//exp
+#include <cmath>
+
+#include "Rate.hpp"
+
+namespace sqtop {
+
+// window of each ring in milliseconds
+static const long long ring_windows[3] = { 5000, 30000, 60000 };
+
+void RateMeter::Add(long long stamp, long long bytes) {
+   // counter went back (e.g. id was reused by another request), start over
+   if (bytes < last_bytes) *this = RateMeter();
+   if (!Empty()) {
+      long long elapsed = stamp - last_stamp;
+      if (elapsed <= 0) return;
+      last_rate = (bytes - last_bytes) * 1000 / elapsed;
+      if (have_rate) {
+         double alpha = 1.0 - exp(-static_cast<double>(elapsed) / RATE_EWMA_TAU);
+         ewma += alpha * (last_rate - ewma);
+      } else {
+         ewma = last_rate;
+         have_rate = true;
+      }
+   }
+   last_stamp = stamp;
+   last_bytes = bytes;
+
+   for (int i = 0; i < 3; ++i) {
+      RateRing& ring = rings[i];
+      if ((ring.count != 0) && (stamp - ring.stamp[ring.head] < ring_windows[i] / 4))
+         continue;
+      ring.head = (ring.head + 1) % RATE_RING_SLOTS;
+      ring.stamp[ring.head] = stamp;
+      ring.bytes[ring.head] = bytes;
+      if (ring.count < RATE_RING_SLOTS) ring.count++;
+   }
+}
+
+long RateMeter::WindowRate(const RateRing& ring, long long window) const {
+   // oldest sample not older than window; if all are older, the newest one before last sample
+   int found = -1;
+   for (int n = ring.count - 1; n >= 0; --n) {
+      int slot = (ring.head + RATE_RING_SLOTS - n) % RATE_RING_SLOTS;
+      long long age = last_stamp - ring.stamp[slot];
+      if (age <= 0) break;
+      found = slot;
+      if (age <= window) break;
+   }
+   if (found < 0) return last_rate;
+   return (last_bytes - ring.bytes[found]) * 1000 / (last_stamp - ring.stamp[found]);
+}
+
+long RateMeter::Rate(Options::RATE_WINDOW window) const {
+   if (!have_rate) return 0;
+   switch (window) {
+      case Options::RATE_5S:
+         return WindowRate(rings[0], ring_windows[0]);
+      case Options::RATE_30S:
+         return WindowRate(rings[1], ring_windows[1]);
+      case Options::RATE_60S:
+         return WindowRate(rings[2], ring_windows[2]);
+      case Options::RATE_EWMA:
+         return static_cast<long>(ewma);
+      case Options::RATE_LAST:
+      default:
+         return last_rate;
+   }
+}
+
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
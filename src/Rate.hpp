@@ -0,0 +1,58 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __RATE_H
+#define __RATE_H
+
+#include "options.hpp"
+
+// time constant of exponentially weighted moving average, in milliseconds
+#define RATE_EWMA_TAU 10000
+// samples kept for each window
+#define RATE_RING_SLOTS 5
+
+namespace sqtop {
+
+// Few samples of cumulative bytes spaced by 1/4 of window, enough to look one window back.
+struct RateRing {
+   long long stamp[RATE_RING_SLOTS];
+   long long bytes[RATE_RING_SLOTS];
+   unsigned char head; // slot of newest sample
+   unsigned char count;
+   RateRing() : head(0), count(0) {};
+};
+
+// Transfer rate of something that transferred cumulative bytes by time stamp (ms).
+// Each Add is O(1), rates for all windows are available after it.
+class RateMeter {
+   public:
+      RateMeter() : last_stamp(0), last_bytes(0), last_rate(0), ewma(0), have_rate(false) {};
+
+      // meter is restarted if bytes decrease
+      void Add(long long stamp, long long bytes);
+      // bytes per second for window, 0 until there are two samples
+      long Rate(Options::RATE_WINDOW window) const;
+      bool Empty() const { return last_stamp == 0; }
+      long long LastBytes() const { return last_bytes; }
+      long long LastStamp() const { return last_stamp; }
+
+   private:
+      long WindowRate(const RateRing& ring, long long window) const;
+
+      long long last_stamp;
+      long long last_bytes;
+      // rate between two last samples
+      long last_rate;
+      double ewma;
+      bool have_rate;
+      // 5, 30 and 60 seconds
+      RateRing rings[3];
+};
+
+}
+
+#endif /* __RATE_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,173 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+//strcmp
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#include "Scan.hpp"
+
+// chars with signed value up to this one are stripped from lines
+#define SCAN_CONTROL_MAX 30
+
+namespace Scan {
+
+struct Impl {
+   const char* name;
+   const char* (*find_byte)(const char* begin, const char* end, char c);
+   const char* (*find_control)(const char* begin, const char* end);
+};
+
+static const char* ScalarFindByte(const char* begin, const char* end, char c) {
+   for (const char* p = begin; p != end; ++p) {
+      if (*p == c) return p;
+   }
+   return end;
+}
+
+static const char* ScalarFindControl(const char* begin, const char* end) {
+   for (const char* p = begin; p != end; ++p) {
+      if (static_cast<signed char>(*p) <= SCAN_CONTROL_MAX) return p;
+   }
+   return end;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static const char* Sse2FindByte(const char* begin, const char* end, char c) {
+   const char* p = begin;
+   const __m128i needle = _mm_set1_epi8(c);
+   for (; end - p >= 16; p += 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+      if (mask != 0) return p + __builtin_ctz(mask);
+   }
+   return ScalarFindByte(p, end, c);
+}
+
+__attribute__((target("sse2")))
+static const char* Sse2FindControl(const char* begin, const char* end) {
+   const char* p = begin;
+   const __m128i limit = _mm_set1_epi8(SCAN_CONTROL_MAX);
+   for (; end - p >= 16; p += 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      // bit is set for every char we keep, compare is signed like in scalar version
+      int keep = _mm_movemask_epi8(_mm_cmpgt_epi8(chunk, limit));
+      if (keep != 0xFFFF) return p + __builtin_ctz(~keep);
+   }
+   return ScalarFindControl(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* Avx2FindByte(const char* begin, const char* end, char c) {
+   const char* p = begin;
+   const __m256i needle = _mm256_set1_epi8(c);
+   for (; end - p >= 32; p += 32) {
+      __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+      unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+      if (mask != 0) return p + __builtin_ctz(mask);
+   }
+   if (end - p >= 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(needle)));
+      if (mask != 0) return p + __builtin_ctz(mask);
+      p += 16;
+   }
+   return ScalarFindByte(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char* Avx2FindControl(const char* begin, const char* end) {
+   const char* p = begin;
+   const __m256i limit = _mm256_set1_epi8(SCAN_CONTROL_MAX);
+   for (; end - p >= 32; p += 32) {
+      __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+      unsigned int keep = _mm256_movemask_epi8(_mm256_cmpgt_epi8(chunk, limit));
+      if (keep != 0xFFFFFFFFu) return p + __builtin_ctz(~keep);
+   }
+   if (end - p >= 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      int keep = _mm_movemask_epi8(_mm_cmpgt_epi8(chunk, _mm256_castsi256_si128(limit)));
+      if (keep != 0xFFFF) return p + __builtin_ctz(~keep);
+      p += 16;
+   }
+   return ScalarFindControl(p, end);
+}
+#endif
+
+static const Impl impls[] = {
+#ifdef SCAN_X86
+   { "avx2", Avx2FindByte, Avx2FindControl },
+   { "sse2", Sse2FindByte, Sse2FindControl },
+#endif
+   { "scalar", ScalarFindByte, ScalarFindControl }
+};
+
+static bool Supported(const Impl& impl) {
+#ifdef SCAN_X86
+   __builtin_cpu_init();
+   if (impl.find_byte == Avx2FindByte) return __builtin_cpu_supports("avx2");
+   if (impl.find_byte == Sse2FindByte) return __builtin_cpu_supports("sse2");
+#endif
+   return true;
+}
+
+static const Impl* Detect() {
+   const size_t count = sizeof(impls)/sizeof(impls[0]);
+   for (size_t i = 0; i < count; ++i) {
+      if (Supported(impls[i])) return &impls[i];
+   }
+   return &impls[count-1];
+}
+
+static const Impl* pImpl = Detect();
+
+const char* FindByte(const char* begin, const char* end, char c) {
+   return pImpl->find_byte(begin, end, c);
+}
+
+const char* FindControl(const char* begin, const char* end) {
+   return pImpl->find_control(begin, end);
+}
+
+size_t StripControl(char* line, size_t len) {
+   char* end = line + len;
+   char* ctrl = const_cast<char*>(pImpl->find_control(line, end));
+   // usual case, nothing to strip
+   if (ctrl == end) return len;
+   char* out = ctrl;
+   for (char* p = ctrl + 1; p != end; ++p) {
+      if (static_cast<signed char>(*p) > SCAN_CONTROL_MAX) *out++ = *p;
+   }
+   return out - line;
+}
+
+char* SkipControl(char* begin, char* end) {
+   // lines are indented with a tab or two, not worth vectorizing
+   while ((begin != end) && (static_cast<signed char>(*begin) <= SCAN_CONTROL_MAX)) ++begin;
+   return begin;
+}
+
+const char* Name() {
+   return pImpl->name;
+}
+
+bool Use(const char* name) {
+   for (size_t i = 0; i < sizeof(impls)/sizeof(impls[0]); ++i) {
+      if ((strcmp(impls[i].name, name) == 0) && Supported(impls[i])) {
+         pImpl = &impls[i];
+         return true;
+      }
+   }
+   return false;
+}
+
+};
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,30 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <cstddef>
+
+// Byte scanning for the receive buffer.
+// SSE2 and AVX2 versions are picked at runtime, scalar version gives the same results.
+namespace Scan {
+   // first c in [begin, end), end if not found
+   extern const char* FindByte(const char* begin, const char* end, char c);
+   // first control char (signed value <= 30) in [begin, end), end if not found
+   extern const char* FindControl(const char* begin, const char* end);
+   // removes control chars in place, returns new length
+   extern size_t StripControl(char* line, size_t len);
+   // skips leading control chars, returns pointer to first other char or end
+   extern char* SkipControl(char* begin, char* end);
+   // name of implementation in use: "avx2", "sse2" or "scalar"
+   extern const char* Name();
+   // switch to implementation by name, false if cpu does not support it
+   extern bool Use(const char* name);
+};
+
+#endif /* __SCAN_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
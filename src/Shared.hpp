@@ -0,0 +1,99 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __SHARED_H
+#define __SHARED_H
+
+#include <cstddef>
+
+namespace sqtop {
+
+// Reference counted pointer to object that is not changed after it was shared.
+// References may be copied and dropped in different threads.
+template <typename T>
+class SharedRef {
+   public:
+      SharedRef() : pNode(NULL) {};
+      // takes ownership of pObject
+      explicit SharedRef(T* pObject) : pNode(new Node(pObject)) {};
+      SharedRef(const SharedRef& other) : pNode(other.pNode) {
+         Acquire(pNode);
+      }
+      SharedRef& operator = (const SharedRef& other) {
+         Acquire(other.pNode);
+         Release(pNode);
+         pNode = other.pNode;
+         return *this;
+      }
+      ~SharedRef() {
+         Release(pNode);
+      }
+
+      const T* operator -> () const { return pNode->pObject; }
+      const T& operator * () const { return *pNode->pObject; }
+      bool empty() const { return pNode == NULL; }
+
+   private:
+      template <typename U> friend class Mailbox;
+
+      struct Node {
+         T* pObject;
+         int refs;
+         explicit Node(T* pObject) : pObject(pObject), refs(1) {};
+         ~Node() { delete pObject; }
+      };
+
+      static void Acquire(Node* pNode) {
+         if (pNode != NULL)
+            __atomic_add_fetch(&pNode->refs, 1, __ATOMIC_RELAXED);
+      }
+      static void Release(Node* pNode) {
+         if ((pNode != NULL) && (__atomic_sub_fetch(&pNode->refs, 1, __ATOMIC_ACQ_REL) == 0))
+            delete pNode;
+      }
+
+      Node* pNode;
+};
+
+// Single slot for handing newest object from one thread to another without locks.
+// Writer replaces object that reader did not take yet, so reader always gets the newest one.
+template <typename T>
+class Mailbox {
+   public:
+      Mailbox() : pSlot(NULL) {};
+      ~Mailbox() {
+         SharedRef<T>::Release(pSlot);
+      }
+
+      void Publish(const SharedRef<T>& object) {
+         typename SharedRef<T>::Node* pNode = object.pNode;
+         SharedRef<T>::Acquire(pNode);
+         // reference that was in slot belongs to us after exchange
+         SharedRef<T>::Release(__atomic_exchange_n(&pSlot, pNode, __ATOMIC_ACQ_REL));
+      }
+
+      // false if nothing was published since last Take
+      bool Take(SharedRef<T>& object) {
+         typename SharedRef<T>::Node* pNode = __atomic_exchange_n(&pSlot, static_cast<typename SharedRef<T>::Node*>(NULL), __ATOMIC_ACQ_REL);
+         if (pNode == NULL) return false;
+         // slot reference is moved to object
+         SharedRef<T>::Release(object.pNode);
+         object.pNode = pNode;
+         return true;
+      }
+
+   private:
+      // not copyable
+      Mailbox(const Mailbox&);
+      Mailbox& operator = (const Mailbox&);
+
+      typename SharedRef<T>::Node* pSlot;
+};
+
+}
+
+#endif /* __SHARED_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,231 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+//sort, partial_sort
+#include <algorithm>
+
+#include "Sort.hpp"
+#include "Utils.hpp"
+#include "FlatHash.hpp"
+
+using std::string;
+using std::vector;
+using sqtop::Options;
+using sqtop::SquidConnection;
+using sqtop::Atom;
+using sqtop::FlatHash;
+using sqtop::PointerHash;
+
+namespace Sort {
+
+struct KeyName {
+   const char* name;
+   const char* description;
+   Options::SORT_ORDER order;
+};
+
+static const KeyName key_names[] = {
+   { "size",      "size",           Options::SORT_SIZE },
+   { "speed",     "current speed",  Options::SORT_CURRENT_SPEED },
+   { "avspeed",   "average speed",  Options::SORT_AVERAGE_SPEED },
+   { "time",      "max time",       Options::SORT_MAX_TIME },
+   { "ip",        "ip",             Options::SORT_IP },
+   { "user",      "user",           Options::SORT_USER },
+   { "requests",  "requests",       Options::SORT_REQUESTS },
+};
+
+#define KEY_NAMES (sizeof(key_names) / sizeof(key_names[0]))
+
+bool DefaultAscending(Options::SORT_ORDER order) {
+   return (order == Options::SORT_IP) || (order == Options::SORT_USER);
+}
+
+vector<Options::SortKey> Parse(const string& spec) {
+   vector<Options::SortKey> keys;
+   vector<string> names = Utils::SplitString(spec, ",");
+   for (vector<string>::iterator it = names.begin(); it != names.end(); ++it) {
+      string name = *it;
+      int direction = 0;
+      if (!name.empty() && ((name[0] == '+') || (name[0] == '-'))) {
+         direction = (name[0] == '+') ? 1 : -1;
+         name.erase(0, 1);
+      }
+      size_t i;
+      for (i = 0; i < KEY_NAMES; ++i) {
+         if (name == key_names[i].name) break;
+      }
+      if (i == KEY_NAMES)
+         throw std::invalid_argument("unknown key '" + name + "'");
+      Options::SORT_ORDER order = key_names[i].order;
+      keys.push_back(Options::SortKey(order, (direction == 0) ? DefaultAscending(order) : (direction > 0)));
+   }
+   if (keys.empty())
+      throw std::invalid_argument("no keys");
+   return keys;
+}
+
+string Describe(const vector<Options::SortKey>& keys) {
+   string result;
+   for (vector<Options::SortKey>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+      if (!result.empty()) result += ", then ";
+      result += "by ";
+      for (size_t i = 0; i < KEY_NAMES; ++i) {
+         if (key_names[i].order == it->order) result += key_names[i].description;
+      }
+      if (it->ascending != DefaultAscending(it->order))
+         result += it->ascending ? " (ascending)" : " (descending)";
+   }
+   return result;
+}
+
+// signed value as unsigned word with the same order
+static inline uint64_t Word(long long value, bool ascending) {
+   uint64_t word = static_cast<uint64_t>(value) ^ (1ULL << 63);
+   return ascending ? word : ~word;
+}
+
+static inline uint64_t Word(uint64_t value, bool ascending) {
+   return ascending ? value : ~value;
+}
+
+vector<uint32_t> RadixSort(const uint64_t* rows, size_t count, size_t words) {
+   vector<uint32_t> order(count);
+   for (size_t i = 0; i < count; ++i)
+      order[i] = i;
+   if (count < 2) return order;
+   vector<uint32_t> sorted(count);
+   vector<size_t> histograms(8 * 256);
+
+   // least significant word first, every pass keeps order of previous ones for equal digits
+   for (size_t w = words; w-- > 0; ) {
+      // histograms of all bytes of the word in one read
+      std::fill(histograms.begin(), histograms.end(), 0);
+      for (size_t i = 0; i < count; ++i) {
+         uint64_t word = rows[i*words + w];
+         for (int b = 0; b < 8; ++b)
+            histograms[b*256 + ((word >> (b*8)) & 0xff)]++;
+      }
+      for (int b = 0; b < 8; ++b) {
+         const size_t* counts = &histograms[b*256];
+         // all rows have the same digit, pass would not change anything
+         if (counts[(rows[w] >> (b*8)) & 0xff] == count) continue;
+         size_t offsets[256];
+         size_t sum = 0;
+         for (int d = 0; d < 256; ++d) {
+            offsets[d] = sum;
+            sum += counts[d];
+         }
+         for (size_t i = 0; i < count; ++i) {
+            uint32_t row = order[i];
+            sorted[offsets[(rows[row*words + w] >> (b*8)) & 0xff]++] = row;
+         }
+         order.swap(sorted);
+      }
+   }
+   return order;
+}
+
+// compares rows word by word, equal rows by their number
+struct RowLess {
+   const uint64_t* rows;
+   size_t words;
+   RowLess(const uint64_t* rows, size_t words) : rows(rows), words(words) {};
+   bool operator () (uint32_t a, uint32_t b) const {
+      const uint64_t* pA = rows + a*words;
+      const uint64_t* pB = rows + b*words;
+      for (size_t w = 0; w < words; ++w) {
+         if (pA[w] != pB[w]) return pA[w] < pB[w];
+      }
+      return a < b;
+   }
+};
+
+vector<const SquidConnection*> Top(const vector<const SquidConnection*>& conns, const vector<Options::SortKey>& keys, size_t top) {
+   size_t count = conns.size();
+   size_t words = 0;
+   bool by_user = false;
+   for (vector<Options::SortKey>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+      words += (it->order == Options::SORT_IP) ? 2 : 1;
+      if (it->order == Options::SORT_USER) by_user = true;
+   }
+   if (words == 0)
+      return vector<const SquidConnection*>(conns.begin(), conns.begin() + std::min(top, count));
+
+   // users are compared by their rank among first (by name) users of all connections;
+   // they are atoms, so only distinct ones are sorted by name and then looked up by pointer
+   FlatHash<const string*, uint64_t, PointerHash> user_rank;
+   vector<Atom> users;
+   if (by_user) {
+      for (size_t i = 0; i < count; ++i) {
+         if (conns[i]->usernames.empty()) continue;
+         const Atom& user = *conns[i]->usernames.begin();
+         bool inserted;
+         user_rank.Insert(&user.str(), &inserted);
+         if (inserted) users.push_back(user);
+      }
+      std::sort(users.begin(), users.end());
+      for (size_t i = 0; i < users.size(); ++i)
+         *user_rank.Find(&users[i].str()) = i;
+   }
+
+   vector<uint64_t> rows(count * words);
+   for (size_t i = 0; i < count; ++i) {
+      const SquidConnection& conn = *conns[i];
+      uint64_t* pRow = &rows[i*words];
+      for (vector<Options::SortKey>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+         switch (it->order) {
+            case Options::SORT_SIZE:
+               *pRow++ = Word(conn.sum_size, it->ascending);
+               break;
+            case Options::SORT_CURRENT_SPEED:
+               *pRow++ = Word(static_cast<long long>(conn.curr_speed), it->ascending);
+               break;
+            case Options::SORT_AVERAGE_SPEED:
+               *pRow++ = Word(static_cast<long long>(conn.av_speed), it->ascending);
+               break;
+            case Options::SORT_MAX_TIME:
+               *pRow++ = Word(static_cast<long long>(conn.max_etime), it->ascending);
+               break;
+            case Options::SORT_IP:
+               *pRow++ = Word(conn.addr.hi, it->ascending);
+               *pRow++ = Word(conn.addr.lo, it->ascending);
+               break;
+            case Options::SORT_USER: {
+               // connections without user go after all users
+               uint64_t rank = users.size();
+               if (!conn.usernames.empty())
+                  rank = *user_rank.Find(&conn.usernames.begin()->str());
+               *pRow++ = Word(rank, it->ascending);
+               break;
+            }
+            case Options::SORT_REQUESTS:
+               *pRow++ = Word(static_cast<uint64_t>(conn.stats_count), it->ascending);
+               break;
+         }
+      }
+   }
+
+   vector<uint32_t> order;
+   if ((top < count) && (top < count / 16)) {
+      // few rows out of many, heap of top rows is cheaper than sorting all of them
+      order.resize(count);
+      for (size_t i = 0; i < count; ++i)
+         order[i] = i;
+      std::partial_sort(order.begin(), order.begin() + top, order.end(), RowLess(rows.empty() ? NULL : &rows[0], words));
+   } else {
+      order = RadixSort(rows.empty() ? NULL : &rows[0], count, words);
+   }
+   if (top < count)
+      order.resize(top);
+
+   vector<const SquidConnection*> result(order.size());
+   for (size_t i = 0; i < order.size(); ++i)
+      result[i] = conns[order[i]];
+   return result;
+}
+
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,38 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __SORT_H
+#define __SORT_H
+
+#include <string>
+#include <vector>
+//uint64_t
+#include <stdint.h>
+
+#include "options.hpp"
+#include "sqstat.hpp"
+
+// Ordering of connections by several keys.
+// Keys of all connections are taken out once into rows of unsigned words, which compare
+// the same way as keys in requested directions, then rows are sorted with stable radix sort.
+namespace Sort {
+   // first top of conns (all of them if there are less) ordered by keys,
+   // connections equal by all keys keep their order in conns
+   extern std::vector<const sqtop::SquidConnection*> Top(const std::vector<const sqtop::SquidConnection*>& conns,
+                                                         const std::vector<sqtop::Options::SortKey>& keys,
+                                                         size_t top = SIZE_MAX);
+   // stable LSD radix sort of count rows of words unsigned words each, returns row numbers in sorted order
+   extern std::vector<uint32_t> RadixSort(const uint64_t* rows, size_t count, size_t words);
+   // keys from comma-separated names like "size,+ip", throws std::invalid_argument
+   extern std::vector<sqtop::Options::SortKey> Parse(const std::string& spec);
+   // human readable keys, like "by size, then by ip"
+   extern std::string Describe(const std::vector<sqtop::Options::SortKey>& keys);
+   // direction key is sorted in if none is given (bigger first for numbers, ascending for ip and user)
+   extern bool DefaultAscending(sqtop::Options::SORT_ORDER order);
+};
+
+#endif /* __SORT_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
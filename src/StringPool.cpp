@@ -0,0 +1,110 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+//memcmp
+#include <cstring>
+
+#include "StringPool.hpp"
+
+// initial size of hash table, must be power of 2
+#define STRINGPOOL_INITIAL_SLOTS 1024
+
+namespace sqtop {
+
+const std::string Atom::empty_string;
+
+std::ostream& operator << (std::ostream& os, const Atom& atom) {
+   return os << atom.str();
+}
+
+// FNV-1a
+static size_t Hash(const char* data, size_t len) {
+   size_t hash = 2166136261u;
+   for (size_t i = 0; i < len; ++i) {
+      hash ^= static_cast<unsigned char>(data[i]);
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+StringPool::StringPool() : table(STRINGPOOL_INITIAL_SLOTS, NULL), bytes(0), hits(0), refs(0) {
+}
+
+size_t StringPool::Slot(const char* data, size_t len) const {
+   size_t mask = table.size() - 1;
+   size_t slot = Hash(data, len) & mask;
+   while (table[slot] != NULL) {
+      const std::string* pStr = table[slot];
+      if ((pStr->size() == len) && (memcmp(pStr->data(), data, len) == 0))
+         break;
+      slot = (slot + 1) & mask;
+   }
+   return slot;
+}
+
+void StringPool::Grow() {
+   std::vector<const std::string*> old;
+   old.swap(table);
+   table.assign(old.size() * 2, NULL);
+   for (std::vector<const std::string*>::iterator it = old.begin(); it != old.end(); ++it) {
+      if (*it != NULL)
+         table[Slot((*it)->data(), (*it)->size())] = *it;
+   }
+}
+
+Atom StringPool::Intern(const char* data, size_t len) {
+   if (len == 0) return Atom();
+   size_t slot = Slot(data, len);
+   if (table[slot] != NULL) {
+      hits++;
+      return Atom(table[slot]);
+   }
+   strings.push_back(std::string(data, len));
+   const std::string* pStr = &strings.back();
+   table[slot] = pStr;
+   bytes += len;
+   // keep load factor under 1/2
+   if (strings.size() * 2 > table.size())
+      Grow();
+   return Atom(pStr);
+}
+
+Atom StringPool::Find(const std::string& str) const {
+   if (str.empty()) return Atom();
+   size_t slot = Slot(str.data(), str.size());
+   return (table[slot] != NULL) ? Atom(table[slot]) : Atom();
+}
+
+StringPoolRef::StringPoolRef(StringPool* pPool) : pPool(pPool) {
+   if (pPool != NULL)
+      __sync_add_and_fetch(&pPool->refs, 1);
+}
+
+StringPoolRef::StringPoolRef(const StringPoolRef& other) : pPool(other.pPool) {
+   if (pPool != NULL)
+      __sync_add_and_fetch(&pPool->refs, 1);
+}
+
+StringPoolRef& StringPoolRef::operator = (const StringPoolRef& other) {
+   if (other.pPool != NULL)
+      __sync_add_and_fetch(&other.pPool->refs, 1);
+   Release();
+   pPool = other.pPool;
+   return *this;
+}
+
+StringPoolRef::~StringPoolRef() {
+   Release();
+}
+
+void StringPoolRef::Release() {
+   if ((pPool != NULL) && (__sync_sub_and_fetch(&pPool->refs, 1) == 0))
+      delete pPool;
+   pPool = NULL;
+}
+
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
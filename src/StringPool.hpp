@@ -0,0 +1,101 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __STRINGPOOL_H
+#define __STRINGPOOL_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <ostream>
+
+namespace sqtop {
+
+// Handle to string stored in StringPool.
+// Atoms from the same pool are equal only if they point to the same string,
+// so comparing them is a pointer compare. Empty atom is the same for all pools.
+class Atom {
+   public:
+      Atom() : pStr(&empty_string) {};
+
+      const std::string& str() const { return *pStr; }
+      operator const std::string& () const { return *pStr; }
+      const char* c_str() const { return pStr->c_str(); }
+      size_t size() const { return pStr->size(); }
+      bool empty() const { return pStr->empty(); }
+
+      bool operator == (const Atom& other) const { return pStr == other.pStr; }
+      bool operator != (const Atom& other) const { return pStr != other.pStr; }
+      // ordered by value, so containers of atoms keep alphabetical order
+      bool operator < (const Atom& other) const { return (pStr != other.pStr) && (*pStr < *other.pStr); }
+
+   private:
+      friend class StringPool;
+      explicit Atom(const std::string* pstr) : pStr(pstr) {};
+
+      const std::string* pStr;
+      static const std::string empty_string;
+};
+
+std::ostream& operator << (std::ostream& os, const Atom& atom);
+
+// Set of unique strings used by one stats snapshot.
+// Pool is reference counted (see StringPoolRef) and freed with the last snapshot using it.
+class StringPool {
+   public:
+      StringPool();
+
+      Atom Intern(const char* data, size_t len);
+      Atom Intern(const std::string& str) { return Intern(str.data(), str.size()); };
+      // atom for already interned string, empty atom if there is no such string
+      Atom Find(const std::string& str) const;
+
+      // number of unique strings and bytes they take
+      size_t Size() const { return strings.size(); }
+      size_t Bytes() const { return bytes; }
+      // number of Intern calls that returned existing string
+      unsigned long Hits() const { return hits; }
+
+   private:
+      friend class StringPoolRef;
+      // not copyable
+      StringPool(const StringPool&);
+      StringPool& operator = (const StringPool&);
+
+      // slot in table for string, either empty or holding equal string
+      size_t Slot(const char* data, size_t len) const;
+      void Grow();
+
+      // deque does not move elements on push_back, atoms point to them
+      std::deque<std::string> strings;
+      // open addressing hash table, size is power of 2
+      std::vector<const std::string*> table;
+      size_t bytes;
+      unsigned long hits;
+      int refs;
+};
+
+// Shared ownership of StringPool, may be copied between threads.
+class StringPoolRef {
+   public:
+      StringPoolRef() : pPool(NULL) {};
+      explicit StringPoolRef(StringPool* pPool);
+      StringPoolRef(const StringPoolRef& other);
+      StringPoolRef& operator = (const StringPoolRef& other);
+      ~StringPoolRef();
+
+      StringPool* operator -> () const { return pPool; }
+      StringPool* get() const { return pPool; }
+
+   private:
+      void Release();
+      StringPool* pPool;
+};
+
+}
+
+#endif /* __STRINGPOOL_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -0,0 +1,168 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+//max
+#include <algorithm>
+#include <stdexcept>
+
+#include "SubnetTrie.hpp"
+
+using std::string;
+using std::vector;
+using Utils::IPAddr;
+using Utils::StrRef;
+
+namespace sqtop {
+
+void SubnetTotals::Add(const SubnetTotals& other) {
+   hosts += other.hosts;
+   requests += other.requests;
+   size += other.size;
+   av_speed += other.av_speed;
+   curr_speed += other.curr_speed;
+   max_etime = std::max(max_etime, other.max_etime);
+}
+
+SubnetTrie::SubnetTrie() {
+   Clear();
+}
+
+void SubnetTrie::Clear() {
+   nodes.clear();
+   nodes.push_back(Node(0));
+   v4_root = 0;
+   v4_covered = false;
+}
+
+/* static */ int SubnetTrie::Depth(const IPAddr& addr, int bits) {
+   return addr.IsV4() ? bits + 96 : bits;
+}
+
+/* static */ IPAddr SubnetTrie::Network(const IPAddr& addr, int bits) {
+   int depth = Depth(addr, bits);
+   IPAddr network = addr;
+   if (depth <= 0) {
+      network.hi = network.lo = 0;
+   } else if (depth < 64) {
+      network.hi &= ~0ULL << (64 - depth);
+      network.lo = 0;
+   } else if (depth < 128) {
+      network.lo &= ~0ULL << (128 - depth);
+   }
+   return network;
+}
+
+uint32_t SubnetTrie::Insert(const IPAddr& addr, int depth) {
+   uint32_t node = 0;
+   for (int n = 0; n < depth; ++n) {
+      int bit = Bit(addr, n);
+      if (nodes[node].child[bit] == 0) {
+         nodes[node].child[bit] = nodes.size();
+         nodes.push_back(Node(node));
+      }
+      node = nodes[node].child[bit];
+   }
+   return node;
+}
+
+void SubnetTrie::AddPrefix(const IPAddr& addr, int bits) {
+   Mark(addr, Depth(addr, bits));
+}
+
+void SubnetTrie::Mark(const IPAddr& addr, int depth) {
+   nodes[Insert(addr, depth)].prefix = true;
+
+   IPAddr v4(0, 0xffffULL << 32);
+   uint32_t node = 0;
+   for (int n = 0; (n < 96) && !v4_covered; ++n) {
+      v4_covered = nodes[node].prefix;
+      node = nodes[node].child[Bit(v4, n)];
+      if (node == 0) break;
+   }
+   v4_root = node;
+}
+
+void SubnetTrie::Compile(const vector<string>& prefixes) {
+   SubnetTrie compiled;
+   for (vector<string>::const_iterator it = prefixes.begin(); it != prefixes.end(); ++it) {
+      string::size_type slash = it->find('/');
+      string ip = it->substr(0, slash);
+      IPAddr addr;
+      if (!Utils::ParseIP(StrRef(ip.data(), ip.size()), addr))
+         throw std::invalid_argument("wrong address '" + ip + "'");
+      // ::ffff:a.b.c.d/bits counts bits of whole address
+      bool v4_bits = addr.IsV4() && (ip.find(':') == string::npos);
+      int max_bits = v4_bits ? 32 : 128;
+      int bits = max_bits;
+      if (slash != string::npos) {
+         string mask = it->substr(slash + 1);
+         IPAddr mask_addr;
+         if (v4_bits && (mask.find('.') != string::npos) &&
+             Utils::ParseIP(StrRef(mask.data(), mask.size()), mask_addr)) {
+            // dotted mask has to be contiguous ones
+            uint32_t m = mask_addr.lo & 0xffffffffUL;
+            bits = 0;
+            while ((bits < 32) && (m & (0x80000000UL >> bits))) bits++;
+            if ((bits < 32) && ((m << bits) & 0xffffffffUL))
+               throw std::invalid_argument("wrong mask '" + mask + "'");
+         } else {
+            // checked before narrowing, long digit strings would overflow
+            string::size_type digits = mask.find_first_not_of('0');
+            if (mask.empty() || (mask.find_first_not_of("0123456789") != string::npos) ||
+                ((digits != string::npos) && (mask.size() - digits > 3)))
+               throw std::invalid_argument("wrong mask '" + mask + "'");
+            long long len = Utils::ToLL(StrRef(mask.data(), mask.size()));
+            if ((len < 0) || (len > max_bits))
+               throw std::invalid_argument("wrong mask '" + mask + "'");
+            bits = static_cast<int>(len);
+         }
+      }
+      compiled.Mark(addr, v4_bits ? bits + 96 : bits);
+   }
+   nodes.swap(compiled.nodes);
+   v4_root = compiled.v4_root;
+   v4_covered = compiled.v4_covered;
+}
+
+bool SubnetTrie::Covers(const IPAddr& addr) const {
+   uint32_t node = 0;
+   int n = 0;
+   if (addr.IsV4()) {
+      if (v4_covered) return true;
+      if (v4_root == 0) return false;
+      node = v4_root;
+      n = 96;
+   }
+   for (; ; ++n) {
+      if (nodes[node].prefix) return true;
+      if (n == 128) return false;
+      node = nodes[node].child[Bit(addr, n)];
+      if (node == 0) return false;
+   }
+}
+
+void SubnetTrie::AddHost(const IPAddr& addr, const SubnetTotals& totals) {
+   nodes[Insert(addr, 128)].totals.Add(totals);
+}
+
+void SubnetTrie::Aggregate() {
+   // children have bigger indexes than parents, so going back sums every subtree before its root
+   for (size_t node = nodes.size() - 1; node > 0; --node)
+      nodes[nodes[node].parent].totals.Add(nodes[node].totals);
+}
+
+SubnetTotals SubnetTrie::Totals(const IPAddr& addr, int bits) const {
+   int depth = Depth(addr, bits);
+   uint32_t node = 0;
+   for (int n = 0; n < depth; ++n) {
+      node = nodes[node].child[Bit(addr, n)];
+      if (node == 0) return SubnetTotals();
+   }
+   return nodes[node].totals;
+}
+
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
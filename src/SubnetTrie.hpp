@@ -0,0 +1,89 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+#ifndef __SUBNETTRIE_H
+#define __SUBNETTRIE_H
+
+#include <string>
+#include <vector>
+//uint32_t
+#include <stdint.h>
+
+#include "Utils.hpp"
+
+namespace sqtop {
+
+// sums over hosts of a subnet
+struct SubnetTotals {
+   size_t hosts;
+   size_t requests;
+   long long size;
+   long av_speed;
+   long curr_speed;
+   long max_etime;
+   SubnetTotals() : hosts(0), requests(0), size(0), av_speed(0), curr_speed(0), max_etime(0) {};
+   void Add(const SubnetTotals& other);
+};
+
+// Binary trie over 128 bit addresses (IPv4 as IPv4-mapped IPv6), one level per bit.
+// Holds prefixes of hosts filter and/or totals of hosts, which are summed up
+// into every prefix containing them.
+class SubnetTrie {
+   public:
+      SubnetTrie();
+
+      void Clear();
+      bool Empty() const { return nodes.size() == 1; }
+
+      // replaces prefixes by "ip", "ip/bits" or IPv4 "ip/mask" ones (bits of address written
+      // as IPv6 are always of 128), throws std::invalid_argument (and keeps old prefixes) if any is wrong
+      void Compile(const std::vector<std::string>& prefixes);
+      // bits of IPv4 are counted from start of IPv4 part (as in 192.168.0.0/16)
+      void AddPrefix(const Utils::IPAddr& addr, int bits);
+      // addr is inside any of prefixes: single walk from root, stops at first prefix met
+      bool Covers(const Utils::IPAddr& addr) const;
+
+      // totals of host, added to all subnets containing it by Aggregate
+      void AddHost(const Utils::IPAddr& addr, const SubnetTotals& totals);
+      // sums totals of hosts bottom-up, must be called once, after last AddHost
+      void Aggregate();
+      // totals of hosts in addr/bits (bits as in AddPrefix), empty if there are none
+      SubnetTotals Totals(const Utils::IPAddr& addr, int bits) const;
+
+      // first addr of addr/bits, e.g. 192.168.1.0 for 192.168.1.5/24
+      static Utils::IPAddr Network(const Utils::IPAddr& addr, int bits);
+
+   private:
+      struct Node {
+         // 0 - no child, root (node 0) is never a child
+         uint32_t child[2];
+         uint32_t parent;
+         // one of filter prefixes ends here
+         bool prefix;
+         SubnetTotals totals;
+         Node(uint32_t parent) : parent(parent), prefix(false) { child[0] = child[1] = 0; };
+      };
+
+      // node of addr/depth (depth in bits of 128 bit address), created with its parents if needed
+      uint32_t Insert(const Utils::IPAddr& addr, int depth);
+      void Mark(const Utils::IPAddr& addr, int depth);
+      static int Depth(const Utils::IPAddr& addr, int bits);
+      static int Bit(const Utils::IPAddr& addr, int n) {
+         return (n < 64) ? (addr.hi >> (63 - n)) & 1 : (addr.lo >> (127 - n)) & 1;
+      }
+
+      // parents are always created before children, so every child has bigger index
+      std::vector<Node> nodes;
+      // all IPv4 addresses share first 96 bits, so Covers starts from node of ::ffff:0:0/96
+      // (0 if there is none) and only checks whether prefix above it covers all of them
+      uint32_t v4_root;
+      bool v4_covered;
+};
+
+}
+
+#endif /* __SUBNETTRIE_H */
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -15,8 +15,15 @@
 #include <cerrno>
 //LONG_MIN, LONG_MAX
 #include <climits>
+//isspace
+#include <cctype>
+//clock_gettime
+#include <time.h>
+//gettimeofday
+#include <sys/time.h>
 
 #include "Utils.hpp"
+#include "Scan.hpp"
 
 using std::string;
 using std::vector;
@@ -36,6 +43,123 @@ vector<string> Utils::SplitString(string str, string delim) {
    return result;
 }
 
+// same splitting as SplitString with single char delim, but without copying:
+// fills at most max_parts references, returns number of parts found
+size_t Utils::SplitRef(StrRef str, char delim, StrRef* parts, size_t max_parts) {
+   size_t found = 0;
+   const char* p = str.data;
+   const char* end = str.data + str.len;
+   while (p != end) {
+      const char* d = Scan::FindByte(p, end, delim);
+      if (found < max_parts) parts[found] = StrRef(p, d - p);
+      found++;
+      if (d == end) break;
+      p = d + 1;
+   }
+   return found;
+}
+
+// like atoll(), but for not null-terminated string
+long long Utils::ToLL(StrRef str) {
+   const char* p = str.data;
+   const char* end = str.data + str.len;
+   while ((p != end) && isspace(*p)) ++p;
+   bool negative = false;
+   if ((p != end) && ((*p == '-') || (*p == '+'))) {
+      negative = (*p == '-');
+      ++p;
+   }
+   long long result = 0;
+   for (; (p != end) && (*p >= '0') && (*p <= '9'); ++p) {
+      result = result*10 + (*p - '0');
+   }
+   return negative ? -result : result;
+}
+
+bool Utils::ParseIP(StrRef text, IPAddr& addr) {
+   if ((text.len >= 2) && (text.data[0] == '[') && (text.data[text.len-1] == ']')) {
+      text.data++;
+      text.len -= 2;
+   }
+   char buf[INET6_ADDRSTRLEN];
+   if ((text.len == 0) || (text.len >= sizeof(buf))) return false;
+   memcpy(buf, text.data, text.len);
+   buf[text.len] = '\0';
+
+   unsigned char bytes[16];
+   if (memchr(text.data, ':', text.len) != NULL) {
+      if (inet_pton(AF_INET6, buf, bytes) != 1) return false;
+   } else {
+      memset(bytes, 0, 10);
+      bytes[10] = bytes[11] = 0xff;
+      if (inet_pton(AF_INET, buf, bytes + 12) != 1) return false;
+   }
+   addr.hi = addr.lo = 0;
+   for (int i = 0; i < 8; ++i) {
+      addr.hi = (addr.hi << 8) | bytes[i];
+      addr.lo = (addr.lo << 8) | bytes[i+8];
+   }
+   return true;
+}
+
+string Utils::FormatIP(const IPAddr& addr) {
+   unsigned char bytes[16];
+   for (int i = 0; i < 8; ++i) {
+      bytes[i] = addr.hi >> (56 - i*8);
+      bytes[i+8] = addr.lo >> (56 - i*8);
+   }
+   char buf[INET6_ADDRSTRLEN];
+   if (addr.IsV4())
+      inet_ntop(AF_INET, bytes + 12, buf, sizeof(buf));
+   else
+      inet_ntop(AF_INET6, bytes, buf, sizeof(buf));
+   return buf;
+}
+
+Utils::StrRef Utils::UrlHost(StrRef url) {
+   const char* p = url.data;
+   const char* end = url.data + url.len;
+   // skip "scheme://", if there is one before path starts
+   for (const char* s = p; (s != end) && (*s != '/') && (*s != '?') && (*s != '#'); ++s) {
+      if (*s == ':') {
+         if ((end - s >= 3) && (s[1] == '/') && (s[2] == '/')) p = s + 3;
+         break;
+      }
+   }
+   const char* host_end = p;
+   while ((host_end != end) && (*host_end != '/') && (*host_end != '?') && (*host_end != '#'))
+      ++host_end;
+   // "user:password@"
+   for (const char* s = host_end; s != p; --s) {
+      if (s[-1] == '@') {
+         p = s;
+         break;
+      }
+   }
+   const char* host = p;
+   if ((p != host_end) && (*p == '[')) {
+      while ((p != host_end) && (*p != ']')) ++p;
+      if (p != host_end) ++p;
+   } else {
+      while ((p != host_end) && (*p != ':')) ++p;
+   }
+   // fully qualified "example.com."
+   if ((p != host) && (p[-1] == '.')) --p;
+   return StrRef(host, p - host);
+}
+
+long long Utils::SecondsToMs(StrRef str) {
+   const char* dot = static_cast<const char*>(memchr(str.data, '.', str.len));
+   if (dot == NULL) return ToLL(str) * 1000;
+   long long ms = ToLL(StrRef(str.data, dot - str.data)) * 1000;
+   long long scale = 100;
+   for (const char* p = dot + 1; (p != str.data + str.len) && (scale > 0) && (*p >= '0') && (*p <= '9'); ++p) {
+      ms += (*p - '0') * scale;
+      scale /= 10;
+   }
+   return ms;
+}
+
 std::pair <string, string> Utils::SplitIPPort(string ipport) {
    std::pair <string, string> result;
    std::string::size_type found = ipport.find_last_of(":");
@@ -158,9 +282,9 @@ string Utils::ConvertSpeed(long long speed) {
    return result.first+" "+result.second;
 }
 
-bool Utils::SetFindSubstr(set<string>& v, const string& str) {
-   for(set<string>::iterator it = v.begin(); it != v.end(); ++it) {
-      if ((*it).find(str) != string::npos) return true;
+bool Utils::SetFindSubstr(set<sqtop::Atom>& v, const string& str) {
+   for(set<sqtop::Atom>::iterator it = v.begin(); it != v.end(); ++it) {
+      if (it->str().find(str) != string::npos) return true;
    }
    return false;
 }
@@ -169,7 +293,7 @@ bool Utils::MemberOf(vector<string>& v, const string& str) {
      return find(v.begin(), v.end(), str) != v.end();
 }
 
-void Utils::VectorDeleteStr(vector<string>& v, string& str) {
+void Utils::VectorDeleteStr(vector<string>& v, const string& str) {
    vector<string>::iterator vItr = v.begin();
    while ( vItr != v.end() ) {
       if ( (*vItr) == str ) {
@@ -181,37 +305,18 @@ void Utils::VectorDeleteStr(vector<string>& v, string& str) {
    }
 }
 
-bool Utils::IPMemberOf(vector<string>& v, string& ip_in) {
-     for (vector<string>::iterator it = v.begin(); it != v.end(); ++it) {
-        vector<string> ip_mask = SplitString(*it, "/");
-        unsigned long int ip = inet_addr(ip_mask[0].c_str());
-        unsigned long int mask;
-        if (ip_mask.size() > 1) {
-           if (ip_mask[1].size() > 2) {
-               mask = inet_addr(ip_mask[1].c_str());
-           } else {
-               std::stringstream ss(ip_mask[1]);
-               int mask_bits;
-               ss >> mask_bits;
-               mask = mask_bits ? htonl(0xfffffffful << (32 - mask_bits)) : 0;
-           }
-        } else {
-           mask = inet_addr("255.255.255.255");
-        }
-        if ((inet_addr (ip_in.c_str()) & mask) == ip)
-           return true;
-    }
-    return false;
-}
-
 void Utils::ToLower(string& rData) {
      transform(rData.begin(), rData.end(), rData.begin(), ::tolower);
 }
 
-bool Utils::UserMemberOf(vector<string>& v, set<string>& users) {
-     for (set<string>::iterator it = users.begin(); it != users.end(); ++it) {
-         if (MemberOf(v, *it))
-            return true;
+bool Utils::UserMemberOf(vector<sqtop::Atom>& v, const set<sqtop::Atom>& users) {
+     for (vector<sqtop::Atom>::iterator it = v.begin(); it != v.end(); ++it) {
+         // filter user never seen in snapshot
+         if (it->empty()) continue;
+         for (set<sqtop::Atom>::const_iterator itu = users.begin(); itu != users.end(); ++itu) {
+            if (*it == *itu)
+               return true;
+         }
      }
      return false;
 }
@@ -225,4 +330,20 @@ string Utils::replace(string text, string s, string d) {
   return text;
 }
 
+// microseconds from some unspecified point, not affected by system clock changes
+long long Utils::MonotonicUs() {
+#ifdef CLOCK_MONOTONIC
+   struct timespec ts;
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+      return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#endif
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+long long Utils::MonotonicMs() {
+   return MonotonicUs()/1000;
+}
+
 // vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -9,11 +9,67 @@
 #include <string>
 #include <vector>
 #include <set>
+//memcmp, strlen
+#include <cstring>
+//uint64_t
+#include <stdint.h>
 
 #include <stdexcept>
 
+#include "StringPool.hpp"
+
 namespace Utils {
+   // non-owning reference to part of a string, valid while referenced data lives
+   struct StrRef {
+      const char* data;
+      size_t len;
+      StrRef() : data(NULL), len(0) {};
+      StrRef(const char* data, size_t len) : data(data), len(len) {};
+      bool empty() const { return len == 0; }
+      std::string str() const { return std::string(data, len); }
+      bool StartsWith(const char* prefix, size_t prefix_len) const {
+         return (len >= prefix_len) && (memcmp(data, prefix, prefix_len) == 0);
+      }
+      bool operator == (const char* s) const {
+         return (strlen(s) == len) && (memcmp(data, s, len) == 0);
+      }
+   };
+
+   // IPv4 or IPv6 address packed in 128 bits, IPv4 is kept as IPv4-mapped IPv6 (::ffff:a.b.c.d),
+   // so addresses are ordered by plain integer compare
+   struct IPAddr {
+      uint64_t hi;
+      uint64_t lo;
+      IPAddr() : hi(0), lo(0) {};
+      IPAddr(uint64_t hi, uint64_t lo) : hi(hi), lo(lo) {};
+      bool IsV4() const { return (hi == 0) && ((lo >> 32) == 0xffff); }
+      bool operator == (const IPAddr& other) const { return (hi == other.hi) && (lo == other.lo); }
+      bool operator < (const IPAddr& other) const { return (hi < other.hi) || ((hi == other.hi) && (lo < other.lo)); }
+   };
+
+   struct IPAddrHash {
+      size_t operator () (const IPAddr& addr) const {
+         uint64_t h = addr.hi ^ (addr.lo * 0x9e3779b97f4a7c15ULL);
+         h ^= h >> 32;
+         h *= 0xbf58476d1ce4e5b9ULL;
+         h ^= h >> 29;
+         return static_cast<size_t>(h);
+      }
+   };
+
+   // parses IPv4 or IPv6 (optionally in brackets) address, false if text is not an address
+   extern bool ParseIP(StrRef text, IPAddr& addr);
+   // text form of address, IPv4-mapped addresses as plain IPv4
+   extern std::string FormatIP(const IPAddr& addr);
+   // host of url ("http://user@Host.com:8080/x" -> "Host.com", "host:443" of CONNECT -> "host")
+   // as reference into url, IPv6 address keeps its brackets
+   extern StrRef UrlHost(StrRef url);
+
    extern std::vector<std::string> SplitString(std::string str, std::string delim);
+   extern size_t SplitRef(StrRef str, char delim, StrRef* parts, size_t max_parts);
+   extern long long ToLL(StrRef str);
+   // "12.345678" seconds to 12345 milliseconds
+   extern long long SecondsToMs(StrRef str);
    extern std::pair <std::string, std::string> SplitIPPort(std::string ipport);
    extern std::string JoinVector(std::vector<std::string> inv, std::string delim);
    extern std::string itos(long long num);
@@ -26,12 +82,14 @@ namespace Utils {
    extern std::pair <std::string, std::string> ConvertSpeedPair(long long speed);
    extern std::string ConvertSpeed(long long speed);
    extern bool MemberOf(std::vector<std::string>& v, const std::string& str);
-   extern void VectorDeleteStr(std::vector<std::string>& v, std::string& str);
-   extern bool SetFindSubstr(std::set<std::string>& v, const std::string& str);
-   extern bool IPMemberOf(std::vector<std::string>& v, std::string& ip_in);
+   extern void VectorDeleteStr(std::vector<std::string>& v, const std::string& str);
+   extern bool SetFindSubstr(std::set<sqtop::Atom>& v, const std::string& str);
    extern void ToLower(std::string& rData);
-   extern bool UserMemberOf(std::vector<std::string>& v, std::set<std::string>& users);
+   // v is list of users interned in the same pool as users
+   extern bool UserMemberOf(std::vector<sqtop::Atom>& v, const std::set<sqtop::Atom>& users);
    extern std::string replace(std::string text, std::string s, std::string d);
+   extern long long MonotonicMs();
+   extern long long MonotonicUs();
 };
 
 #endif /* __UTILS_H */
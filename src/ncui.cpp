@@ -14,6 +14,9 @@
 
 #include "ncui.hpp"
 #include "Utils.hpp"
+#include "Scan.hpp"
+#include "Sort.hpp"
+#include "Pivot.hpp"
 #include "strings.hpp"
 
 #ifdef NCURSES_IN_SUBDIR
@@ -38,12 +41,13 @@ std::ostream& operator<<( std::ostream& os, const Options::SPEED_MODE& mode )
    return os;
 }
 
-std::ostream& operator<<( std::ostream& os, const Options::SORT_ORDER& order ) {
-   switch (order) {
-      case Options::SORT_SIZE: os << "by size"; break;
-      case Options::SORT_CURRENT_SPEED: os << "by current speed"; break;
-      case Options::SORT_AVERAGE_SPEED: os << "by average speed"; break;
-      case Options::SORT_MAX_TIME: os << "by max time"; break;
+std::ostream& operator<<( std::ostream& os, const Options::RATE_WINDOW& window ) {
+   switch (window) {
+      case Options::RATE_LAST: os << "since last refresh"; break;
+      case Options::RATE_5S: os << "last 5 seconds"; break;
+      case Options::RATE_30S: os << "last 30 seconds"; break;
+      case Options::RATE_60S: os << "last 60 seconds"; break;
+      case Options::RATE_EWMA: os << "moving average"; break;
    }
    return os;
 }
@@ -57,13 +61,40 @@ inline void operator++(Options::SPEED_MODE& mode, int) {
 }
 
 inline void operator++(Options::SORT_ORDER& order, int) {
-   if (order >= Options::SORT_MAX_TIME) {
+   if (order >= Options::SORT_REQUESTS) {
       order = Options::SORT_SIZE;
    } else {
       order = Options::SORT_ORDER(order + 1);
    }
 }
 
+std::ostream& operator<<( std::ostream& os, const Options::GROUP_BY& group ) {
+   switch (group) {
+      case Options::GROUP_HOST: os << "hosts"; break;
+      case Options::GROUP_USER: os << "users"; break;
+      case Options::GROUP_DELAY_POOL: os << "delay pools"; break;
+      case Options::GROUP_SUBNET: os << "subnets"; break;
+      case Options::GROUP_DOMAIN: os << "domains"; break;
+   }
+   return os;
+}
+
+inline void operator++(Options::GROUP_BY& group, int) {
+   if (group >= Options::GROUP_DOMAIN) {
+      group = Options::GROUP_HOST;
+   } else {
+      group = Options::GROUP_BY(group + 1);
+   }
+}
+
+inline void operator++(Options::RATE_WINDOW& window, int) {
+   if (window >= Options::RATE_EWMA) {
+      window = Options::RATE_LAST;
+   } else {
+      window = Options::RATE_WINDOW(window + 1);
+   }
+}
+
 #ifdef WITH_RESOLVER
 std::ostream& operator<<( std::ostream& os, const Options::RESOLVE_MODE& mode )
 {
@@ -102,6 +133,9 @@ ncui::ncui(Options* pgOpts) {
    start = 0;
    //ticks = 0;
    Opts = *pGlobalOpts;
+   snapshot = SharedRef<SquidStats>(new SquidStats());
+   pivot_strip_user_domain = pGlobalOpts->strip_user_domain;
+   pivot_revision = 0;
 }
 
 ncui::~ncui() {
@@ -153,8 +187,12 @@ void ncui::ClearError() {
    error.erase();
 }
 
-void ncui::SetStat(SquidStats stats) {
-   sqstats = stats;
+void ncui::SetStat(const SharedRef<SquidStats>& stats) {
+   incoming.Publish(stats);
+}
+
+void ncui::ResetStats() {
+   incoming.Publish(SharedRef<SquidStats>(new SquidStats()));
 }
 
 string ncui::b2s(bool value) {
@@ -182,7 +220,9 @@ string ncui::helpmsg() {
    ss << " c - " << compact_same_help << " " << b2s(pGlobalOpts->compactsameurls) << endl;
    ss << " Z - " << strip_user_domain_help << " " << b2s(pGlobalOpts->strip_user_domain) << endl;
    ss << " s - " << "speed showing mode (" << pGlobalOpts->speed_mode << ")" << endl;
-   ss << " o - " << "connections sort order (" << pGlobalOpts->sort_order << ")" << endl;
+   ss << " o/O - " << "connections sort order/reverse it (" << Sort::Describe(pGlobalOpts->sort_keys) << ")" << endl;
+   ss << " w - " << "current speed window (" << pGlobalOpts->rate_window << ")" << endl;
+   ss << " g - " << "group requests by hosts, users, delay pools, subnets or domains (" << pGlobalOpts->group_by << ")" << endl;
    ss << " SPACE - stop refreshing " << b2s(!pGlobalOpts->do_refresh) << endl;
    ss << " UP/DOWN/PAGE_UP/PAGE_DOWN/HOME/END keys - scroll display" << endl;
    ss << " ENTER - toggle showing/hiding: urls (for connections), full details (for urls)" << endl;
@@ -204,12 +244,31 @@ string ncui::helpmsg() {
    if (!pGlobalOpts->pass.empty())
       pass = " (" + pGlobalOpts->pass + ")";
    ss << " P - " << passwd_help << pass << endl;
+   ss << " connect/fetch timeouts: " << pGlobalOpts->connect_timeout << "/" << pGlobalOpts->fetch_timeout << " ms" << endl;
+   ss << " K - " << keepalive_help << " " << b2s(pGlobalOpts->keepalive) << endl;
    ss << " r - " << refresh_interval_help << " (" << Utils::itos(pGlobalOpts->sleep_sec) << ")" << endl;
+   ss << " last fetch: " << Utils::ConvertSize(snapshot->read_bytes) << " in " << snapshot->read_calls << " reads"
+      << ", get time: " << snapshot->get_time << " ms"
+      << ", process time: " << snapshot->process_time << " ms"
+      << ", address lookups: " << snapshot->addr_lookups << endl;
+   if (snapshot->parse_time > 0) {
+      // parse_time is in microseconds
+      ss << " parser: " << snapshot->parse_lines << " lines, "
+         << Utils::itos(snapshot->parse_lines * 1000000LL / snapshot->parse_time) << " lines/s, "
+         << Utils::ConvertSize(snapshot->parse_bytes * 1000000LL / snapshot->parse_time) << "/s"
+         << " (" << Scan::Name() << " scanner)" << endl;
+   }
+   ss << " speed history: " << snapshot->oldstats_size << " requests, forgotten "
+      << snapshot->oldstats_evicted << " on last fetch, " << snapshot->oldstats_evicted_total << " total" << endl;
    ss << endl;
 #ifdef WITH_RESOLVER
    ss << "Resolver (working in " << pResolver->ResolveMode() << " mode with "
                                  << pResolver->ResolveFunc() << " in "
-                                 << pResolver->MaxThreads() << " threads):" << endl;
+                                 << pResolver->MaxThreads() << " threads, "
+                                 << pResolver->Queued() << " hosts queued, "
+                                 << pResolver->Cached() << " cached):" << endl;
+   ss << " fetch waited for resolver " << pResolver->LockWaits() << " times, "
+      << Utils::itos(pResolver->LockWaitUs() / 1000) << " ms total" << endl;
    ss << " n - " << dns_resolution_help << " " << b2s(pGlobalOpts->dns_resolution) << endl;
    ss << " S - " << strip_host_domain_help << " " << b2s(pGlobalOpts->strip_host_domain) << endl;
    ss << " R - " << "hosts showing mode (" << pGlobalOpts->resolve_mode << ")" << endl;
@@ -224,6 +283,36 @@ string ncui::helpmsg() {
    return ss.str();
 }
 
+const SquidStats& ncui::View() {
+   if (pGlobalOpts->group_by == Options::GROUP_HOST)
+      return *snapshot;
+   if ((pivot.generation != snapshot->generation) || (pivot.group_by != pGlobalOpts->group_by) ||
+       (pivot_strip_user_domain != pGlobalOpts->strip_user_domain)) {
+      Pivot::Group(*snapshot, pGlobalOpts->group_by, pGlobalOpts->strip_user_domain, pivot);
+      pivot_strip_user_domain = pGlobalOpts->strip_user_domain;
+      pivot_revision++;
+   }
+   return pivot;
+}
+
+void ncui::CompactStats(const SquidStats& view, SquidConnection& conn, size_t index, size_t top) {
+   if (compacted.size() < view.connections.size())
+      compacted.resize(view.connections.size());
+   struct CompactedStats& cached = compacted[index];
+   if ((cached.generation != view.generation) || (cached.group_by != view.group_by) ||
+       (cached.revision != pivot_revision) || (cached.top < top)) {
+      view.stats.Fill(conn);
+      compactor.Compact(conn, top);
+      cached.generation = view.generation;
+      cached.group_by = view.group_by;
+      cached.revision = pivot_revision;
+      cached.top = top;
+      cached.stats = conn.stats;
+   } else {
+      conn.stats = cached.stats;
+   }
+}
+
 int ncui::CompactLongLine(string &line) {
    int len = line.size();
    int coef = len / COLS;
@@ -240,26 +329,29 @@ int ncui::CompactLongLine(string &line) {
    return coef;
 }
 
-/* static */ bool ncui::Filter(SquidConnection scon, Options* pOpts) {
-   if (((pOpts->Hosts.size() == 0) || Utils::IPMemberOf(pOpts->Hosts, scon.peer)) &&
-       ((pOpts->Users.size() == 0) || Utils::UserMemberOf(pOpts->Users, scon.usernames))) {
+/* static */ bool ncui::Filter(const SquidConnection& scon, Options* pOpts, vector<Atom>& users) {
+   if (((pOpts->Hosts.size() == 0) || sqstat::HostMemberOf(pOpts->hosts_filter, scon)) &&
+       ((pOpts->Users.size() == 0) || Utils::UserMemberOf(users, scon.usernames))) {
          return false;
    }
    return true;
 }
 
-vector<SquidConnection> ncui::FilterConns(vector<SquidConnection> in) {
-   vector<SquidConnection>::iterator it;
-   it = std::remove_if( in.begin(), in.end(), std::bind2nd(std::ptr_fun(Filter), pGlobalOpts) );
-   in.erase(it, in.end());
-   return in;
+vector<const SquidConnection*> ncui::FilterConns(const vector<SquidConnection>& in) {
+   vector<Atom> users = sqstat::FilterUsers(*snapshot, pGlobalOpts->Users);
+   vector<const SquidConnection*> result;
+   for (vector<SquidConnection>::const_iterator it = in.begin(); it != in.end(); ++it) {
+      if (!Filter(*it, pGlobalOpts, users))
+         result.push_back(&*it);
+   }
+   return result;
 }
 
 bool ncui::SearchString(SquidConnection scon, string search_string) {
    bool ret = false;
    if (!search_string.empty()) {
       bool in_host = false;
-      bool in_ip = (scon.peer.find(search_string) != string::npos);
+      bool in_ip = (scon.peer.str().find(search_string) != string::npos);
 #ifdef WITH_RESOLVER
       bool in_name = (scon.hostname.find(search_string) != string::npos);
       switch (pGlobalOpts->resolve_mode) {
@@ -287,35 +379,22 @@ vector<formattedline_t> ncui::FormatConnections(vector<SquidConnection> conns, i
    vector<formattedline_t> result;
    int coef = 0;
    unsigned int y = offset;
-
-   bool (*compareFunc)(SquidConnection, SquidConnection) = NULL;
-   switch (pGlobalOpts->sort_order) {
-      case Options::SORT_SIZE:
-         compareFunc = &sqstat::CompareSIZE;
-         break;
-      case Options::SORT_CURRENT_SPEED:
-         compareFunc = &sqstat::CompareCURRSPEED;
-         break;
-      case Options::SORT_AVERAGE_SPEED:
-         compareFunc = &sqstat::CompareAVSPEED;
-         break;
-      case Options::SORT_MAX_TIME:
-         compareFunc = &sqstat::CompareTIME;
-         break;
-   };
-
-   if (compareFunc != NULL)
-      sort(conns.begin(), conns.end(), compareFunc);
+   bool tree = pGlobalOpts->TreeView();
+   // rows deeper than that are inside collapsed row of tree
+   int hidden_below = INT_MAX;
 
    for (vector<SquidConnection>::iterator it = conns.begin(); it != conns.end(); ++it) {
       SquidConnection scon = *it;
+      if (scon.depth > hidden_below) continue;
+      hidden_below = INT_MAX;
+      string indent(2 * scon.depth, ' ');
       Opts = *pGlobalOpts;
       if ((not pGlobalOpts->brief) && (Utils::MemberOf(collapsed, scon.peer))) {
          Opts.brief = true;
       } else if ((pGlobalOpts->brief) && (Utils::MemberOf(collapsed, scon.peer))) {
          Opts.brief = false;
       }
-      string header_str = sqstat::ConnFormat(&Opts, scon);
+      string header_str = indent + sqstat::ConnFormat(&Opts, scon);
       coef = CompactLongLine(header_str);
       result.push_back( formattedline_t(header_str, y, coef, scon, "") );
       if (SearchString(scon, search_string)) {
@@ -328,6 +407,12 @@ vector<formattedline_t> ncui::FormatConnections(vector<SquidConnection> conns, i
       }
       y += coef;
 
+      // collapsing row of tree also hides rows below it, row without requests (subnet) has no urls
+      if (tree && Utils::MemberOf(collapsed, scon.peer))
+         hidden_below = scon.depth;
+      if (tree && (scon.stats_count == 0))
+         continue;
+
       if (((not pGlobalOpts->brief) && (not Utils::MemberOf(collapsed, scon.peer))) ||
           ((pGlobalOpts->brief) && (Utils::MemberOf(collapsed, scon.peer)))) {
          for (vector<UriStats>::iterator itu = scon.stats.begin(); itu != scon.stats.end(); ++itu) {
@@ -338,10 +423,10 @@ vector<formattedline_t> ncui::FormatConnections(vector<SquidConnection> conns, i
                Opts.full = true;
                Opts.compactlongurls = false;
             }
-            string url_str = sqstat::StatFormat(&Opts, scon, ustat);
+            string url_str = indent + sqstat::StatFormat(&Opts, scon, ustat);
             coef = CompactLongLine(url_str);
             result.push_back( formattedline_t(url_str, y, coef, scon, ustat.id));
-            if ((!search_string.empty()) && (ustat.uri.find(search_string) != string::npos)) {
+            if ((!search_string.empty()) && (ustat.uri.str().find(search_string) != string::npos)) {
                if (selected_index > result.size() - 1)
                   increment = -1;
                else
@@ -363,7 +448,7 @@ vector<formattedline_t> ncui::FormatConnections(vector<SquidConnection> conns, i
          y++;
       }
    }
-   if ((not pGlobalOpts->brief) && (result.size() > 0))
+   if ((not pGlobalOpts->brief) && (result.size() > 0) && (result[result.size()-1].new_line))
       result.pop_back();
    if ((result.size() > 0) && (result[result.size()-1].new_line))
       result.pop_back();
@@ -382,6 +467,8 @@ vector<formattedline_t> ncui::FormatConnections(vector<SquidConnection> conns, i
 
 void ncui::Print() {
    if (pGlobalOpts->freeze) return;
+   // pick up newest snapshot from squid_loop, if any
+   incoming.Take(snapshot);
    clear();
 
    std::stringstream header_r, header_l, active_conn, active_ips, average_speed, status;
@@ -413,10 +500,28 @@ void ncui::Print() {
       offset++;
    }
 
-   vector<SquidConnection> sqconns_filtered = FilterConns(sqstats.connections);
+   // every connection and url takes at least one line, so only that much of them
+   // can get on screen (search and END need all of them)
+   size_t visible = SIZE_MAX;
+   if (search_string.empty() && (selected_index != UINT_MAX))
+      visible = selected_index + LINES;
+   const SquidStats& view = View();
+   vector<const SquidConnection*> top;
+   if (pGlobalOpts->TreeView())
+      // tree keeps its own order
+      top = FilterConns(view.connections);
+   else
+      top = Sort::Top(FilterConns(view.connections), pGlobalOpts->sort_keys, visible);
+   vector<SquidConnection> sqconns_filtered;
+   sqconns_filtered.reserve(top.size());
+   for (vector<const SquidConnection*>::iterator it = top.begin(); it != top.end(); ++it) {
+      sqconns_filtered.push_back(**it);
+      if (pGlobalOpts->compactsameurls)
+         CompactStats(view, sqconns_filtered.back(), *it - &view.connections[0], visible);
+      else
+         view.stats.Fill(sqconns_filtered.back());
+   }
 
-   if (pGlobalOpts->compactsameurls)
-      sqstat::CompactSameUrls(sqconns_filtered);
    to_print = FormatConnections(sqconns_filtered, offset);
 
    // HEADER: print help hint
@@ -464,6 +569,10 @@ void ncui::Print() {
          }
 
          unsigned int y;
+#ifdef WITH_RESOLVER
+         // hosts on screen are resolved first
+         vector<string> on_screen;
+#endif
          for (vector<formattedline_t>::iterator it = to_print.begin()+start; it != to_print.end(); ++it) {
             formattedline_t fline = *it;
             if (fline.new_line) {
@@ -475,6 +584,10 @@ void ncui::Print() {
             if ((y + fline.coef - 1) > (max_y - 2)) break;
 
             mvaddstr(y, 0, fline.str.c_str());
+#ifdef WITH_RESOLVER
+            if (fline.id.empty() && fline.sconn.peers.empty())
+               on_screen.push_back(fline.sconn.peer);
+#endif
 
             if (fline.highlighted) {
                //AddWatch("id", fline.id);
@@ -492,6 +605,10 @@ void ncui::Print() {
                selected_t = fline;
             }
          }
+#ifdef WITH_RESOLVER
+         if (pGlobalOpts->dns_resolution)
+            pResolver->Prioritize(on_screen);
+#endif
          /*AddWatch("incr", Utils::itos(increment));
          AddWatch("max_y", Utils::itos(max_y));
          AddWatch("y_coef", Utils::itos(y_coef));
@@ -505,13 +622,13 @@ void ncui::Print() {
    }
 
    // FOOTER
-   string speed = sqstat::SpeedsFormat(pGlobalOpts->speed_mode, sqstats.av_speed, sqstats.curr_speed);
+   string speed = sqstat::SpeedsFormat(pGlobalOpts->speed_mode, snapshot->av_speed, snapshot->curr_speed);
    speed[0] = toupper(speed[0]);
    status << speed << "\t\t";
-   status << "Active hosts: " << sqstats.connections.size() << "\t\t";
-   status << "Active connections: " << sqstats.total_connections << "\t\t";
-   //status << "Get time: " << sqstats.get_time << "\t";
-   //status << "Process time: " << sqstats.process_time << "\t";
+   status << "Active hosts: " << snapshot->connections.size() << "\t\t";
+   status << "Active connections: " << snapshot->total_connections << "\t\t";
+   //status << "Get time: " << snapshot->get_time << "\t";
+   //status << "Process time: " << snapshot->process_time << "\t";
 
    mvhline(max_y-1, 0, 0, COLS);
 
@@ -579,7 +696,7 @@ void ncui::Loop() {
             try {
                inp = EdLine(0, "Cachemgr password", pGlobalOpts->pass);
                pGlobalOpts->pass = inp;
-               sqstats.connections.clear();
+               ResetStats();
             } catch (const std::invalid_argument& error) {
                ShowHelpHint(error.what());
             }
@@ -589,7 +706,9 @@ void ncui::Loop() {
             pGlobalOpts->freeze = true;
             try {
                inp = EdLine(0, "Hosts to show", Utils::JoinVector(pGlobalOpts->Hosts, ","));
-               pGlobalOpts->Hosts = Utils::SplitString(inp, ",");
+               vector<string> hosts = Utils::SplitString(inp, ",");
+               pGlobalOpts->hosts_filter.Compile(hosts);
+               pGlobalOpts->Hosts = hosts;
             } catch (const std::invalid_argument& error) {
                ShowHelpHint(error.what());
             }
@@ -636,6 +755,14 @@ void ncui::Loop() {
             }
             pGlobalOpts->compactsameurls = !pGlobalOpts->compactsameurls;
             break;
+         case 'K':
+            if (pGlobalOpts->keepalive) {
+               ShowHelpHint("Keeping connection to Squid open OFF");
+            } else {
+               ShowHelpHint("Keeping connection to Squid open ON");
+            }
+            pGlobalOpts->keepalive = !pGlobalOpts->keepalive;
+            break;
          case 'Z':
             if (pGlobalOpts->strip_user_domain) {
                ShowHelpHint("Username domain part stripping OFF");
@@ -669,9 +796,30 @@ void ncui::Loop() {
             ShowHelpHint(ss.str());
             break;
          case 'o':
-            pGlobalOpts->sort_order++;
+            // other first key, rest of keys are kept for ties
+            pGlobalOpts->sort_keys[0].order++;
+            pGlobalOpts->sort_keys[0].ascending = Sort::DefaultAscending(pGlobalOpts->sort_keys[0].order);
+            ss.str("");
+            ss << "Connections sort order - " << Sort::Describe(pGlobalOpts->sort_keys);
+            ShowHelpHint(ss.str());
+            break;
+         case 'O':
+            pGlobalOpts->sort_keys[0].ascending = !pGlobalOpts->sort_keys[0].ascending;
+            ss.str("");
+            ss << "Connections sort order - " << Sort::Describe(pGlobalOpts->sort_keys);
+            ShowHelpHint(ss.str());
+            break;
+         case 'g':
+            pGlobalOpts->group_by++;
+            ss.str("");
+            ss << "Grouping by " << pGlobalOpts->group_by;
+            ShowHelpHint(ss.str());
+            break;
+         case 'w':
+            pGlobalOpts->rate_window++;
             ss.str("");
-            ss << "Connections sort order - " << pGlobalOpts->sort_order;
+            // speeds are computed by fetch thread, so it takes effect from next refresh
+            ss << "Current speed window - " << pGlobalOpts->rate_window << " (from next refresh)";
             ShowHelpHint(ss.str());
             break;
 #ifdef WITH_RESOLVER
@@ -687,7 +835,7 @@ void ncui::Loop() {
             try {
                inp = EdLine(0, "Squid host", pGlobalOpts->host);
                if (inp != "") pGlobalOpts->host = inp;
-               sqstats.connections.clear();
+               ResetStats();
             } catch (const std::invalid_argument& error) {
                ShowHelpHint(error.what());
             }
@@ -710,7 +858,7 @@ void ncui::Loop() {
                if (inp != "") {
                   long int port = Utils::stol(inp);
                   pGlobalOpts->port = port;
-                  sqstats.connections.clear();
+                  ResetStats();
                }
             } catch (const std::exception& error) {
                ShowHelpHint(error.what());
@@ -59,7 +59,10 @@ class ncui {
       void SetError(std::string);
       void ClearError();
 
-      void SetStat(SquidStats);
+      // publishes new snapshot, never blocks; may be called from other thread
+      void SetStat(const SharedRef<SquidStats>& stats);
+      // drops shown connections (e.g. after switching to other squid)
+      void ResetStats();
 
    private:
       int CompactLongLine(std::string &line);
@@ -90,7 +93,37 @@ class ncui {
       std::string debug;
       void AddWatch(std::string prefix, std::string value);
 
-      SquidStats sqstats;
+      // snapshot being shown, used only under tick_mutex
+      SharedRef<SquidStats> snapshot;
+      // newest snapshot from SetStat, not yet shown
+      Mailbox<SquidStats> incoming;
+
+      // snapshot grouped by user or delay pool, regrouped only when snapshot or grouping changes
+      SquidStats pivot;
+      bool pivot_strip_user_domain;
+      // bumped on every regrouping of pivot, which changes its rows without changing generation
+      unsigned long pivot_revision;
+      // snapshot as connections are grouped by pGlobalOpts->group_by
+      const SquidStats& View();
+
+      // requests of one connection of view with same urls merged
+      struct CompactedStats {
+         // SquidStats::generation, group_by and pivot_revision of view compacted stats belong to,
+         // generation 0 if none
+         unsigned long generation;
+         Options::GROUP_BY group_by;
+         unsigned long revision;
+         // how many first urls are ordered
+         size_t top;
+         std::vector<UriStats> stats;
+         CompactedStats() : generation(0), group_by(Options::GROUP_HOST), revision(0), top(0) {};
+      };
+      // snapshots never change, so stats are compacted once per view and
+      // connection (by its index in view) and reused by following redraws
+      std::vector<CompactedStats> compacted;
+      UrlCompactor compactor;
+      // conn.stats with same urls merged, ordered at least for first top urls
+      void CompactStats(const SquidStats& view, SquidConnection& conn, size_t index, size_t top);
 
       std::string helphintmsg;
       time_t helptimer;
@@ -103,8 +136,9 @@ class ncui {
       formattedline_t selected_t;
 
       std::vector<formattedline_t> FormatConnections(std::vector<SquidConnection> conns, int offset);
-      static bool Filter(SquidConnection scon, Options* pOpts);
-      std::vector<SquidConnection> FilterConns(std::vector<SquidConnection> in);
+      static bool Filter(const SquidConnection& scon, Options* pOpts, std::vector<Atom>& users);
+      // connections of in that pass filters
+      std::vector<const SquidConnection*> FilterConns(const std::vector<SquidConnection>& in);
       int increment;
       unsigned int y_coef;
       unsigned int start;
@@ -11,6 +11,8 @@
 
 #include "config.h"
 
+#include "SubnetTrie.hpp"
+
 #ifdef WITH_RESOLVER
 #include <resolver.hpp>
 #endif
@@ -22,22 +24,31 @@ class Options {
       Options() :
          host("127.0.0.1"), port(3128), pass(""),
          brief(false), full(false), zero(false), detail(false),
-         ui(true),
+         ui(true), keepalive(true), top(0),
+         connect_timeout(3000), fetch_timeout(10000),
          compactlongurls(true), compactsameurls(true),
          strip_user_domain(true),
          freeze(false), do_refresh(true), sleep_sec(2),
          showhelp(false), showhelphint(false),
-         speed_mode(SPEED_MIXED), sort_order(SORT_SIZE)
+         speed_mode(SPEED_MIXED),
+         rate_window(RATE_LAST),
+         group_by(GROUP_HOST)
 #ifdef WITH_RESOLVER
          ,dns_resolution(true),
          strip_host_domain(true),
          resolve_mode(SHOW_BOTH)
 #endif
-      {};
+      {
+         sort_keys.push_back(SortKey(SORT_SIZE, false));
+      };
 
       std::string host; int port; std::string pass;
       bool brief; bool full; bool zero; bool detail;
-      bool ui;
+      bool ui; bool keepalive;
+      // print only that many connections first in sort_keys order (0 - all in address order)
+      unsigned long top;
+      // in milliseconds, 0 - wait forever
+      long connect_timeout; long fetch_timeout;
       bool compactlongurls; bool compactsameurls;
       bool strip_user_domain;
       bool freeze; bool do_refresh; int sleep_sec;
@@ -54,9 +65,41 @@ class Options {
          SORT_SIZE,
          SORT_CURRENT_SPEED,
          SORT_AVERAGE_SPEED,
-         SORT_MAX_TIME
+         SORT_MAX_TIME,
+         SORT_IP,
+         SORT_USER,
+         SORT_REQUESTS
+      };
+      struct SortKey {
+         SORT_ORDER order;
+         bool ascending;
+         SortKey(SORT_ORDER order, bool ascending) : order(order), ascending(ascending) {};
+      };
+      // connections are ordered by first key, equal ones by next key and so on,
+      // equal by all keys stay in address order
+      std::vector<SortKey> sort_keys;
+
+      // what current speed is averaged over
+      enum RATE_WINDOW {
+         RATE_LAST, // time between two last fetches
+         RATE_5S,
+         RATE_30S,
+         RATE_60S,
+         RATE_EWMA
+      };
+      RATE_WINDOW rate_window;
+
+      // what requests are grouped by into connections
+      enum GROUP_BY {
+         GROUP_HOST,
+         GROUP_USER, // username with domain stripped if strip_user_domain is set
+         GROUP_DELAY_POOL,
+         GROUP_SUBNET, // tree of /16 and /24 (/48 and /64 for IPv6) subnets and their hosts
+         GROUP_DOMAIN // tree of destination domains (com, example.com, cdn.example.com)
       };
-      SORT_ORDER sort_order;
+      GROUP_BY group_by;
+      // connections are rows of tree, which keeps its own order
+      bool TreeView() const { return (group_by == GROUP_SUBNET) || (group_by == GROUP_DOMAIN); }
 #ifdef WITH_RESOLVER
       bool dns_resolution;
       bool strip_host_domain;
@@ -70,6 +113,8 @@ class Options {
 #endif
 
       std::vector<std::string> Hosts;
+      // Hosts compiled with SubnetTrie::Compile
+      SubnetTrie hosts_filter;
       std::vector<std::string> Users;
 };
 
@@ -12,22 +12,37 @@
 #include <netdb.h>
 #include <algorithm>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <pthread.h>
 
 #include "resolver.hpp"
+#include "Utils.hpp"
 
 using std::cout;
 using std::cerr;
 using std::endl;
 using std::string;
-using std::map;
 using std::vector;
 
 Resolver::Resolver() {
    resolve_func = "NONE";
    max_threads = 0;
+   pThreadArgs = NULL;
+   job_seq = 0;
+   use_dns = false;
+   wake_pipe[0] = wake_pipe[1] = -1;
+   dirty = false;
+   saved_at = 0;
+   mailbox_size = 0;
+   cached_count = 0;
+   lock_waits = 0;
+   lock_wait_us = 0;
 }
 
 void Resolver::Start() {
@@ -45,8 +60,18 @@ void Resolver::init() {
    /* getnameinfo (on *BSD) and gethostbyaddr is notreentrant */
    max_threads = 1;
 #endif
+   // single thread keeps hundreds of queries in flight, blocking functions are fallback
+   if (dns.Open() && (pipe(wake_pipe) == 0)) {
+      use_dns = true;
+      max_threads = 1;
+      for (int i = 0; i < 2; ++i) {
+         fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+         fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+      }
+   }
    pthread_mutexattr_init(&mAttr);
    pthread_mutex_init(&rMutex, &mAttr);
+   pthread_mutex_init(&mMutex, &mAttr);
 
    pthread_condattr_init(&cAttr);
    pthread_cond_init(&rCond, &cAttr);
@@ -59,27 +84,51 @@ void Resolver::init() {
 #elif defined(USE_GETHOSTBYADDR)
    resolve_func = "GETHOSTBYADDR";
 #endif
+   if (use_dns)
+      resolve_func = "DNS";
    //cout << "Using " << resolve_func << " in " << max_threads << " threads"<< endl;
 
+   Load();
+
    pThreadArgs = new ThreadArgs[max_threads];
    for(int i = 0; i < max_threads; i++) {
       pThreadArgs[i].pMain = this;
       pThreadArgs[i].ThreadNum = i;
-      pthread_create(&pThreadArgs[i].pthWorker, NULL, (void *(*) (void *)) &Worker, (void *) &pThreadArgs[i]);
+      pThreadArgs[i].locked = false;
+      pthread_create(&pThreadArgs[i].pthWorker, NULL, (void *(*) (void *)) (use_dns ? &DnsWorker : &Worker),
+                     (void *) &pThreadArgs[i]);
    }
 }
 
 Resolver::~Resolver() {
+   if (pThreadArgs == NULL) return;
+
+   // workers should be gone before destroying mutex and cond they are waiting on
+   for (int i = 0; i < max_threads; i++) {
+       pthread_cancel(pThreadArgs[i].pthWorker);
+   }
+   for (int i = 0; i < max_threads; i++) {
+       pthread_join(pThreadArgs[i].pthWorker, NULL);
+   }
+   delete [] pThreadArgs;
+
+   // copy handed to workers by SaveLater may be not taken yet (dirty is cleared by then);
+   // copy taken is written completely, WriteCache can't be canceled
+   Drain();
+   if (dirty || !save_data.empty())
+      WriteCache(Serialize());
+
    pthread_mutex_destroy(&rMutex);
+   pthread_mutex_destroy(&mMutex);
    pthread_mutexattr_destroy(&mAttr);
 
    pthread_cond_destroy(&rCond);
    pthread_condattr_destroy(&cAttr);
 
-   for (int i = 0; i < max_threads; i++) {
-       pthread_cancel(pThreadArgs[i].pthWorker);
+   if (use_dns) {
+      close(wake_pipe[0]);
+      close(wake_pipe[1]);
    }
-   delete [] pThreadArgs;
 }
 
 string Resolver::ResolveFunc() {
@@ -119,85 +168,443 @@ string Resolver::ResolveMode() {
    Resolver* pMain = reinterpret_cast<Resolver*>(pThreadArgs->pMain);
    //int num = pThreadArgs->ThreadNum;
    pthread_mutex_lock(&pMain->rMutex);
+   pThreadArgs->locked = true;
+   pthread_cleanup_push(&WorkerCleanup, pThreadArg);
    //cout << "------- worker (" << num << "): locked" << endl;
-   string name;
+   string ip;
+   vector<DnsClient::Answer> done(1, DnsClient::Answer(""));
    // /etc/hosts
    //sethostent(1);
+   string data;
    while (true) {
-      //cout << "q size = " << pMain->queue.size() << endl;
-      while (not pMain->queue.empty()) {
-         string ip = pMain->queue.front();
-         pMain->queue.pop_front();
-         // workaround for the condition when ip deleted from queue but not resolved yet can be added again
-         pMain->resolved[ip] = ip;
+      // cache handed over by SaveLater is written before next job
+      data.swap(pMain->save_data);
+      while (!data.empty() || pMain->TakeJob(ip)) {
+         pThreadArgs->locked = false;
          pthread_mutex_unlock(&pMain->rMutex);
-         string name = DoResolve(ip);
+         if (!data.empty()) {
+            WriteCache(data);
+            data.clear();
+            pthread_mutex_lock(&pMain->rMutex);
+            pThreadArgs->locked = true;
+            continue;
+         }
+         // ip stays pending (as running) until it is resolved, so it is not queued again meanwhile
+         done[0] = DnsClient::Answer(ip);
+         done[0].found = DoResolve(ip, done[0].name);
          pthread_mutex_lock(&pMain->rMutex);
-         pMain->resolved[ip] = name;
-         //cout << "------- worker (" << num << "): resolved " << ip << " to " << name << ". " << pMain->queue.size() << " to go." << endl;
+         pThreadArgs->locked = true;
+         // name is posted before ip stops being pending, see HandOff
+         pMain->Post(done);
+         pMain->pending.Erase(ip);
+         //cout << "------- worker (" << num << "): resolved " << ip << " to " << name << ". " << pMain->pending.Size() << " to go." << endl;
+         data.swap(pMain->save_data);
       }
       //cout << "------- worker (" << num << "): waiting for cond" << endl;
       pthread_cond_wait(&pMain->rCond, &pMain->rMutex);
-      //cout << "------- worker (" << num << "): awaiked " << pMain->queue.size() <<endl;
+      //cout << "------- worker (" << num << "): awaiked " << pMain->pending.Size() <<endl;
    }
+   pthread_cleanup_pop(0);
 }
 
-string Resolver::Resolve(string ip) {
+/* static */ void Resolver::DnsWorker(void* pThreadArg) {
+   ThreadArgs* pThreadArgs = reinterpret_cast<ThreadArgs*>(pThreadArg);
+   Resolver* pMain = reinterpret_cast<Resolver*>(pThreadArgs->pMain);
+   pthread_cleanup_push(&WorkerCleanup, pThreadArg);
+   vector<DnsClient::Answer> answers;
+   vector<string> ips;
+   string ip;
+   string data;
+   char drain[64];
+   while (true) {
+      pthread_mutex_lock(&pMain->rMutex);
+      pThreadArgs->locked = true;
+      pMain->Post(answers);
+      for (vector<DnsClient::Answer>::iterator it = answers.begin(); it != answers.end(); ++it)
+         pMain->pending.Erase(it->ip);
+      // dns is used by this thread only, so it is safe to look at it under lock
+      ips.clear();
+      while ((pMain->dns.InFlight() + ips.size() < DNS_MAX_IN_FLIGHT) && pMain->TakeJob(ip))
+         ips.push_back(ip);
+      data.clear();
+      data.swap(pMain->save_data);
+      pThreadArgs->locked = false;
+      pthread_mutex_unlock(&pMain->rMutex);
+      if (!data.empty()) WriteCache(data);
+
+      answers.clear();
+      for (vector<string>::iterator it = ips.begin(); it != ips.end(); ++it) {
+         // not an address
+         if (!pMain->dns.Query(*it)) answers.push_back(DnsClient::Answer(*it));
+      }
+      pMain->dns.Wait(pMain->wake_pipe[0], answers);
+      while (read(pMain->wake_pipe[0], drain, sizeof drain) > 0);
+   }
+   pthread_cleanup_pop(0);
+}
+
+// canceled worker may hold rMutex (pthread_cond_wait reacquires it on cancel)
+/* static */ void Resolver::WorkerCleanup(void* pThreadArg) {
+   ThreadArgs* pThreadArgs = reinterpret_cast<ThreadArgs*>(pThreadArg);
+   Resolver* pMain = reinterpret_cast<Resolver*>(pThreadArgs->pMain);
+   if (pThreadArgs->locked) {
+      pThreadArgs->locked = false;
+      pthread_mutex_unlock(&pMain->rMutex);
+   }
+}
+
+string Resolver::Resolve(string ip, long long priority) {
    string result;
    switch (resolve_mode) {
       case RESOLVE_SYNC: result = ResolveSync(ip); break;
-      case RESOLVE_ASYNC: result = ResolveAsync(ip); break;
+      case RESOLVE_ASYNC: result = ResolveAsync(ip, priority); break;
    }
    return result;
 }
 
-string Resolver::ResolveAsync(string ip) {
+bool Resolver::Queue(const string& ip, Pending& entry, long long priority) {
+   if (entry.running || ((entry.seq != 0) && (entry.priority == priority))) return false;
+   entry.priority = priority;
+   entry.seq = ++job_seq;
+   jobs.push(Job(priority, entry.seq, ip));
+   // every change of priority leaves old job behind
+   if (jobs.size() > 2 * pending.Size() + 64)
+      CompactJobs();
+   return true;
+}
+
+void Resolver::CompactJobs() {
+   std::priority_queue<Job> fresh;
+   for (size_t slot = 0; slot < pending.Capacity(); ++slot) {
+      if (!pending.Used(slot)) continue;
+      const Pending& entry = pending.ValueAt(slot);
+      if (!entry.running)
+         fresh.push(Job(entry.priority, entry.seq, pending.KeyAt(slot)));
+   }
+   jobs = fresh;
+}
+
+bool Resolver::TakeJob(string& ip) {
+   while (!jobs.empty()) {
+      Job job = jobs.top();
+      jobs.pop();
+      Pending* pEntry = pending.Find(job.ip);
+      // ip was dropped, taken or queued again with other priority
+      if ((pEntry == NULL) || pEntry->running || (pEntry->seq != job.seq)) continue;
+      pEntry->running = true;
+      ip = job.ip;
+      return true;
+   }
+   return false;
+}
+
+void Resolver::Store(const string& ip, bool found, const string& name, time_t now, long ttl) {
+   bool inserted;
+   Entry* pEntry = resolved.Insert(ip, &inserted);
+   if (inserted) {
+      lru.push_front(ip);
+      pEntry->used = lru.begin();
+   }
+   if (found) {
+      if (ttl <= 0) ttl = RESOLVER_TTL;
+      ttl = std::min(std::max(ttl, static_cast<long>(RESOLVER_MIN_TTL)), static_cast<long>(RESOLVER_TTL));
+      pEntry->name = name;
+      pEntry->expires = now + ttl;
+      pEntry->refresh = pEntry->expires - ttl / 10;
+   // failed refresh keeps name until it expires, lookup is retried meanwhile
+   } else if (!pEntry->name.empty() && (now < pEntry->expires)) {
+      pEntry->refresh = std::min(now + RESOLVER_NEGATIVE_TTL, pEntry->expires);
+   } else {
+      pEntry->name.clear();
+      pEntry->expires = pEntry->refresh = now + RESOLVER_NEGATIVE_TTL;
+   }
+   dirty = true;
+   while (resolved.Size() > RESOLVER_MAX_CACHED) {
+      resolved.Erase(lru.back());
+      lru.pop_back();
+   }
+}
+
+string Resolver::ResolveAsync(string ip, long long priority) {
    //cout << "resolve: got " << ip << endl;
-   pthread_mutex_lock(&rMutex);
-   rit = resolved.find(ip);
-   qit = std::find(queue.begin(), queue.end(), ip);
-   string result;
-   bool added = false;
-   // already resolved
-   if (rit != resolved.end()) {
+   if (__atomic_load_n(&mailbox_size, __ATOMIC_ACQUIRE) != 0)
+      Drain();
+   string result = ip;
+   time_t now = time(NULL);
+   Entry* pCached = resolved.Find(ip);
+   if (pCached != NULL) {
       //cout << "resolve: already resolved" << endl;
-      result = rit->second;
-   // not resolved and not in queue
-   } else if (qit == queue.end()) {
-      //cout << "resolve: not resolved and not in queue" << endl;
-      queue.push_back(ip);
-      result = ip;
-      added = true;
-   // not resolved and already in queue
-   } else {
-      //cout << "resolve: not resolved and already in queue" << endl;
-      result = ip;
+      if (!pCached->name.empty()) result = pCached->name;
+      lru.splice(lru.begin(), lru, pCached->used);
+   }
+   // not resolved yet or about to expire
+   if ((pCached == NULL) || (now >= pCached->refresh)) {
+      outbox.push_back(std::make_pair(ip, priority));
+      if (outbox.size() >= RESOLVER_BATCH)
+         HandOff();
+   }
+   return result;
+}
+
+void Resolver::Flush() {
+   HandOff();
+   SaveLater();
+}
+
+void Resolver::HandOff() {
+   if (outbox.empty()) return;
+   Lock(&rMutex);
+   // workers post names before ips stop being pending, so ips resolved since they
+   // were asked for are in cache after this and are not queued again
+   Drain();
+   time_t now = time(NULL);
+   bool added = false;
+   for (vector<std::pair<string, long long> >::iterator it = outbox.begin(); it != outbox.end(); ++it) {
+      Entry* pCached = resolved.Find(it->first);
+      if ((pCached != NULL) && (now < pCached->refresh)) continue;
+      Pending* pEntry = pending.Insert(it->first);
+      // ip on screen keeps priority given by Prioritize
+      if (!pEntry->visible && Queue(it->first, *pEntry, it->second))
+         added = true;
    }
    pthread_mutex_unlock(&rMutex);
+   outbox.clear();
    if (added) {
       //cout << "resolve: signaling" << endl;
+      Wake(true);
+   }
+}
+
+void Resolver::SaveLater() {
+   time_t now = time(NULL);
+   if (!dirty || (now < saved_at + RESOLVER_SAVE_INTERVAL)) return;
+   saved_at = now;
+   // only copy of cache is made here, file is written by worker
+   string data = Serialize();
+   Lock(&rMutex);
+   save_data.swap(data);
+   pthread_mutex_unlock(&rMutex);
+   Wake(false);
+}
+
+void Resolver::Post(const vector<DnsClient::Answer>& answers) {
+   if (answers.empty()) return;
+   pthread_mutex_lock(&mMutex);
+   mailbox.insert(mailbox.end(), answers.begin(), answers.end());
+   __atomic_store_n(&mailbox_size, mailbox.size(), __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&mMutex);
+}
+
+void Resolver::Drain() {
+   Lock(&mMutex);
+   completed.swap(mailbox);
+   __atomic_store_n(&mailbox_size, 0, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&mMutex);
+   time_t now = time(NULL);
+   for (vector<DnsClient::Answer>::iterator it = completed.begin(); it != completed.end(); ++it)
+      Store(it->ip, it->found, it->name, now, it->ttl);
+   completed.clear();
+   __atomic_store_n(&cached_count, resolved.Size(), __ATOMIC_RELAXED);
+}
+
+void Resolver::Lock(pthread_mutex_t* pMutex) {
+   if (pthread_mutex_trylock(pMutex) == 0) return;
+   long long start = Utils::MonotonicUs();
+   pthread_mutex_lock(pMutex);
+   __atomic_add_fetch(&lock_waits, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&lock_wait_us, Utils::MonotonicUs() - start, __ATOMIC_RELAXED);
+}
+
+unsigned long Resolver::LockWaits() {
+   return __atomic_load_n(&lock_waits, __ATOMIC_RELAXED);
+}
+
+long long Resolver::LockWaitUs() {
+   return __atomic_load_n(&lock_wait_us, __ATOMIC_RELAXED);
+}
+
+void Resolver::Prioritize(const vector<string>& ips) {
+   if ((resolve_mode != RESOLVE_ASYNC) || (pThreadArgs == NULL)) return;
+   pthread_mutex_lock(&rMutex);
+   vector<string> previous;
+   previous.swap(on_screen);
+   on_screen = ips;
+   for (vector<string>::iterator it = previous.begin(); it != previous.end(); ++it) {
+      Pending* pEntry = pending.Find(*it);
+      if (pEntry != NULL) pEntry->visible = false;
+   }
+   bool added = false;
+   for (size_t i = 0; i < ips.size(); ++i) {
+      // ips already resolved are not pending
+      Pending* pEntry = pending.Find(ips[i]);
+      if (pEntry == NULL) continue;
+      pEntry->visible = true;
+      // first on screen goes first
+      if (Queue(ips[i], *pEntry, VISIBLE_PRIORITY + static_cast<long long>(ips.size() - i))) added = true;
+   }
+   // scrolled away
+   for (vector<string>::iterator it = previous.begin(); it != previous.end(); ++it) {
+      Pending* pEntry = pending.Find(*it);
+      if ((pEntry != NULL) && !pEntry->visible && !pEntry->running)
+         pending.Erase(*it);
+   }
+   pthread_mutex_unlock(&rMutex);
+   if (added)
+      Wake(true);
+}
+
+void Resolver::Wake(bool all) {
+   if (use_dns) {
+      // pipe may be full, then DnsWorker is about to wake up anyway
+      if (write(wake_pipe[1], "", 1) < 0) return;
+   } else if (all) {
+      pthread_cond_broadcast(&rCond);
+   } else {
       pthread_cond_signal(&rCond);
    }
+}
+
+size_t Resolver::Queued() {
+   if (pThreadArgs == NULL) return 0;
+   pthread_mutex_lock(&rMutex);
+   size_t result = pending.Size();
+   pthread_mutex_unlock(&rMutex);
    return result;
 }
 
+/* static */ string Resolver::CachePath() {
+   const char* dir = getenv("XDG_CACHE_HOME");
+   if ((dir != NULL) && (dir[0] == '/'))
+      return string(dir) + "/" + RESOLVER_CACHE_FILE;
+   const char* home = getenv("HOME");
+   if ((home == NULL) || (home[0] == '\0'))
+      return "";
+   return string(home) + "/.cache/" + RESOLVER_CACHE_FILE;
+}
+
+/* static */ string Resolver::CacheHeader() {
+   uint32_t version = 1;
+   uint32_t order = 0x01020304;
+   string header("sqtopdns", 8);
+   header.append(reinterpret_cast<const char*>(&version), sizeof version);
+   header.append(reinterpret_cast<const char*>(&order), sizeof order);
+   return header;
+}
+
+// cache file is header followed by entries, most recently used first:
+// int64 expires, int64 refresh, uint16 ip length, uint16 name length, ip, name (empty if lookup failed)
+#define RESOLVER_CACHE_ENTRY 20
+
+void Resolver::Load() {
+   string path = CachePath();
+   if (path.empty()) return;
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0) return;
+   struct stat st;
+   string header = CacheHeader();
+   void* data = MAP_FAILED;
+   if ((fstat(fd, &st) == 0) && (static_cast<size_t>(st.st_size) >= header.size()))
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) return;
+
+   const char* pos = static_cast<const char*>(data);
+   const char* end = pos + st.st_size;
+   time_t now = time(NULL);
+   if (memcmp(pos, header.data(), header.size()) == 0) {
+      pos += header.size();
+      while ((pos + RESOLVER_CACHE_ENTRY <= end) && (resolved.Size() < RESOLVER_MAX_CACHED)) {
+         int64_t expires, refresh;
+         uint16_t ip_len, name_len;
+         memcpy(&expires, pos, 8);
+         memcpy(&refresh, pos + 8, 8);
+         memcpy(&ip_len, pos + 16, 2);
+         memcpy(&name_len, pos + 18, 2);
+         pos += RESOLVER_CACHE_ENTRY;
+         if (pos + ip_len + name_len > end) break;
+         string ip(pos, ip_len);
+         string name(pos + ip_len, name_len);
+         pos += ip_len + name_len;
+         // expired name is still shown until it is refreshed, unless it is too old
+         if (name.empty() ? (expires <= now) : (expires + RESOLVER_TTL <= now)) continue;
+         bool inserted;
+         Entry* pEntry = resolved.Insert(ip, &inserted);
+         if (!inserted) continue;
+         pEntry->name = name;
+         pEntry->expires = expires;
+         pEntry->refresh = refresh;
+         pEntry->used = lru.insert(lru.end(), ip);
+      }
+   }
+   munmap(data, st.st_size);
+   saved_at = now;
+   cached_count = resolved.Size();
+}
+
+string Resolver::Serialize() {
+   string data = CacheHeader();
+   data.reserve(data.size() + resolved.Size() * (RESOLVER_CACHE_ENTRY + 32));
+   for (std::list<string>::iterator it = lru.begin(); it != lru.end(); ++it) {
+      const Entry* pEntry = resolved.Find(*it);
+      int64_t expires = pEntry->expires;
+      int64_t refresh = pEntry->refresh;
+      uint16_t ip_len = std::min(it->size(), static_cast<size_t>(0xffff));
+      uint16_t name_len = std::min(pEntry->name.size(), static_cast<size_t>(0xffff));
+      data.append(reinterpret_cast<const char*>(&expires), 8);
+      data.append(reinterpret_cast<const char*>(&refresh), 8);
+      data.append(reinterpret_cast<const char*>(&ip_len), 2);
+      data.append(reinterpret_cast<const char*>(&name_len), 2);
+      data.append(*it, 0, ip_len);
+      data.append(pEntry->name, 0, name_len);
+   }
+   dirty = false;
+   return data;
+}
+
+/* static */ void Resolver::WriteCache(const string& data) {
+   string path = CachePath();
+   if (path.empty()) return;
+   // ~/.cache and sqtop in it
+   for (string::size_type slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+      mkdir(path.substr(0, slash).c_str(), 0700);
+   // other sqtop may be reading it, so file is replaced at once
+   string tmp = path + "." + Utils::itos(getpid());
+   // worker canceled inside write or close would leave temporary file behind
+   int cancel_state;
+   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+   int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd >= 0) {
+      bool written = (write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+      written = (close(fd) == 0) && written;
+      if (!written || (rename(tmp.c_str(), path.c_str()) != 0))
+         unlink(tmp.c_str());
+   }
+   pthread_setcancelstate(cancel_state, NULL);
+}
+
+size_t Resolver::Cached() {
+   return __atomic_load_n(&cached_count, __ATOMIC_RELAXED);
+}
+
 string Resolver::ResolveSync(string ip) {
-   return DoResolve(ip);
+   string name;
+   DoResolve(ip, name);
+   return name;
 }
 
-/* static */ string Resolver::DoResolve(string ip) {
+/* static */ bool Resolver::DoResolve(const string& ip, string& name) {
+   name = ip;
    struct in_addr addr;
    if (!inet_aton(ip.c_str(), &addr)) {
-      return ip;
+      return false;
    }
-   string result;
    try {
-      result = DoRealResolve(&addr);
+      name = DoRealResolve(&addr);
    } catch (const std::runtime_error& error) {
       //cout << "Error resolving " << ip << ": " << error.what() << endl;
-      result = ip;
+      return false;
    }
-   return result;
+   return true;
 }
 
 #ifdef USE_GETNAMEINFO
@@ -7,15 +7,40 @@
 #define __RESOLVER_H
 
 #include <string>
-#include <list>
 #include <vector>
-#include <map>
+#include <list>
+#include <queue>
 #include <stdexcept>
+//LLONG_MAX
+#include <climits>
+//uint64_t
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "config.h"
 
+#include "FlatHash.hpp"
+#include "DnsClient.hpp"
+
 #define MAX_THREADS 3
+// priority of ips on screen (see Prioritize), above any number of bytes
+#define VISIBLE_PRIORITY (LLONG_MAX / 2)
+// seconds to keep resolved names (at most, DNS answers may give less), last tenth of it
+// name is refreshed in background
+#define RESOLVER_TTL 3600
+// lower bound of ttl from DNS answers
+#define RESOLVER_MIN_TTL 60
+// seconds to keep failed lookups
+#define RESOLVER_NEGATIVE_TTL 300
+// names kept in cache, least recently used ones are evicted above it
+#define RESOLVER_MAX_CACHED 65536
+// cache of async mode is kept in $XDG_CACHE_HOME (~/.cache by default) between runs,
+// saved (by Flush) at most once in RESOLVER_SAVE_INTERVAL seconds and on exit
+#define RESOLVER_CACHE_FILE "sqtop/resolver"
+#define RESOLVER_SAVE_INTERVAL 300
+// ips not in cache are handed to workers by Flush, at latest when this many are collected
+#define RESOLVER_BATCH 256
 
 // # caching resolver. Sample usage:
 //////
@@ -26,10 +51,17 @@
 //////
 // # or for async resolve:
 // resolver.Start([int max_threads]);
+// # (with nameservers in /etc/resolv.conf it resolves in one thread by built-in DnsClient,
+// #  max_threads are used by blocking system resolver otherwise)
 // resolver.resolve_mode = Resolver::RESOLVE_ASYNC;
 // cout << resolver.Resolve(string ip);
+// resolver.Flush();
 // # note: first call of Resolve() in async mode always return given ip, 
 // #       next calls may return resolved value (if it has been catched)
+// #       names are cached for RESOLVER_TTL, failures for RESOLVER_NEGATIVE_TTL
+// # ips waiting for workers are resolved in order of their priority:
+// cout << resolver.Resolve(string ip, long long bytes);
+// resolver.Prioritize(vector<string> ips_on_screen);
 //////
 // delete resolver;
 //////
@@ -43,7 +75,23 @@ class Resolver {
 
       enum ResolveMode { RESOLVE_SYNC, RESOLVE_ASYNC };
       ResolveMode resolve_mode;
-      std::string Resolve(std::string ip);
+      // in async mode ip not resolved yet is queued (once), bigger priority (e.g. bytes moved by host)
+      // is resolved first; async Resolve and Flush are called from one thread, they look names up
+      // without locks, names resolved by workers are taken from mailbox in batches
+      std::string Resolve(std::string ip, long long priority = 0);
+      // hands ips collected by Resolve to workers, called after batch of Resolve calls;
+      // also passes changed cache to workers to be saved
+      void Flush();
+      // async mode: ips on screen (top first) are resolved before all others; queued ips that
+      // were on screen before, but are not now, are dropped until they are asked for again
+      void Prioritize(const std::vector<std::string>& ips);
+      // ips waiting for workers or being resolved
+      size_t Queued();
+      // ips in cache of async mode (resolved or failed)
+      size_t Cached();
+      // times Resolve/Flush had to wait for a lock held by workers, and total wait
+      unsigned long LockWaits();
+      long long LockWaitUs();
 
       static bool IsIP(std::string ip);
       static void StripDomain(std::string& rName);
@@ -59,15 +107,124 @@ class Resolver {
       int max_threads;
 
       std::string ResolveSync(std::string ip);
-      std::string ResolveAsync(std::string ip);
+      std::string ResolveAsync(std::string ip, long long priority);
+
+      struct StringHash {
+         size_t operator () (const std::string& str) const {
+            // FNV-1a
+            uint64_t hash = 14695981039346656037ULL;
+            for (size_t i = 0; i < str.size(); ++i) {
+               hash ^= static_cast<unsigned char>(str[i]);
+               hash *= 1099511628211ULL;
+            }
+            return static_cast<size_t>(hash);
+         }
+      };
+      // ip waiting for worker or being resolved
+      struct Pending {
+         long long priority;
+         // of its newest job, older jobs of ip are skipped
+         unsigned long seq;
+         // priority was given by Prioritize
+         bool visible;
+         // taken by worker, is not queued again
+         bool running;
+         Pending() : priority(0), seq(0), visible(false), running(false) {};
+      };
+      struct Job {
+         long long priority;
+         unsigned long seq;
+         std::string ip;
+         Job(long long priority, unsigned long seq, const std::string& ip) : priority(priority), seq(seq), ip(ip) {};
+         // top of heap is the biggest priority, the oldest one of equal
+         bool operator < (const Job& other) const {
+            return (priority < other.priority) || ((priority == other.priority) && (seq > other.seq));
+         }
+      };
+
+      // result of lookup
+      struct Entry {
+         // empty if lookup failed
+         std::string name;
+         // name is not used after it (but still shown until refreshed one comes)
+         time_t expires;
+         // ip is queued again once it is asked for after this time
+         time_t refresh;
+         // position in lru
+         std::list<std::string>::iterator used;
+         Entry() : expires(0), refresh(0) {};
+      };
 
-      std::map <std::string, std::string> resolved;
-      std::map <std::string, std::string>::iterator rit;
-      std::list <std::string> queue;
-      std::list <std::string>::iterator qit;
-      static std::string DoResolve(std::string ip);
+      // used only by thread calling Resolve (and by Start and destructor, when there is no such thread)
+      sqtop::FlatHash<std::string, Entry, StringHash> resolved;
+      // ips of resolved, most recently asked first
+      std::list<std::string> lru;
+      // ips (with priorities) waiting for Flush
+      std::vector<std::pair<std::string, long long> > outbox;
+      // taken from mailbox by Drain
+      std::vector<DnsClient::Answer> completed;
+      // stores result of lookup made at now (ttl of name or 0 for default),
+      // evicts least recently used entries over RESOLVER_MAX_CACHED
+      void Store(const std::string& ip, bool found, const std::string& name, time_t now, long ttl = 0);
+      // queues ips of outbox for workers
+      void HandOff();
+      // moves names from mailbox to cache
+      void Drain();
+      // locks mutex, counting time it was held by someone else
+      void Lock(pthread_mutex_t* pMutex);
+      // cache was changed since last Serialize
+      bool dirty;
+      time_t saved_at;
+      // path of cache file, empty if there is no home for it
+      static std::string CachePath();
+      // magic, version and byte order of cache file
+      static std::string CacheHeader();
+      // fills empty cache from file, before workers are started
+      void Load();
+      // copy of cache in file format, clears dirty
+      std::string Serialize();
+      // writes file (via temporary one)
+      static void WriteCache(const std::string& data);
+      // every RESOLVER_SAVE_INTERVAL hands copy of changed cache to worker, which writes it
+      void SaveLater();
+
+      // read by other threads
+      size_t cached_count;
+      unsigned long lock_waits;
+      long long lock_wait_us;
+
+      // results of workers, under mMutex (never waited on for long: workers hold it only to append);
+      // mailbox_size lets Resolve skip locking when mailbox is empty
+      std::vector<DnsClient::Answer> mailbox;
+      size_t mailbox_size;
+      pthread_mutex_t mMutex;
+      // adds results to mailbox
+      void Post(const std::vector<DnsClient::Answer>& answers);
+      // tells workers there are new jobs
+      void Wake(bool all);
+
+      // all members and calls below are used with rMutex held
+      sqtop::FlatHash<std::string, Pending, StringHash> pending;
+      // heap of pending ips, changing priority of ip leaves its old job in heap
+      std::priority_queue<Job> jobs;
+      unsigned long job_seq;
+      // ips given to last Prioritize call
+      std::vector<std::string> on_screen;
+      // (re)queues ip with priority, true if it was queued
+      bool Queue(const std::string& ip, Pending& entry, long long priority);
+      // next ip to resolve, false if there is none
+      bool TakeJob(std::string& ip);
+      // rebuilds heap without old jobs
+      void CompactJobs();
+      // cache waiting to be written by worker, empty if none
+      std::string save_data;
+      // false (and name is ip) if lookup failed
+      static bool DoResolve(const std::string& ip, std::string& name);
       static std::string DoRealResolve(struct in_addr* addr);
       static void Worker(void* pThreadArg);
+      // the only worker when dns is used
+      static void DnsWorker(void* pThreadArg);
+      static void WorkerCleanup(void* pThreadArg);
 
       pthread_mutex_t rMutex;
       pthread_mutexattr_t mAttr;
@@ -75,10 +232,18 @@ class Resolver {
       pthread_cond_t rCond;
       pthread_condattr_t cAttr;
 
+      // nameservers were found, DnsWorker is used instead of Workers
+      bool use_dns;
+      DnsClient dns;
+      // DnsWorker waits on sockets of dns, so it is woken by byte written into pipe instead of rCond
+      int wake_pipe[2];
+
       struct ThreadArgs {
           pthread_t pthWorker;
           void* pMain;
           int ThreadNum;
+          // worker holds rMutex (to release it if worker is canceled)
+          bool locked;
       };
       ThreadArgs* pThreadArgs;
 };
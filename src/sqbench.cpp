@@ -0,0 +1,799 @@
+/*
+ * (C) 2006 Oleg V. Palij <o.palij@gmail.com>
+ * Released under the GNU GPL, see the COPYING file in the source distribution for its full text.
+ */
+
+// Benchmarks of hot paths on synthetic active_requests data, built with sqtop but not installed.
+// Every benchmark checks that the ways it compares give the same results, exits with 1 if not:
+//////
+// src/sqbench [-n requests] [-c clients] [-r runs] [benchmark...]
+//////
+
+#include "config.h"
+
+#include <unistd.h>
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Utils.hpp"
+#include "Scan.hpp"
+#include "StringPool.hpp"
+#include "sqstat.hpp"
+#include "Rate.hpp"
+#include "Sort.hpp"
+#include "Pivot.hpp"
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+using namespace sqtop;
+
+// requests in synthetic reply, clients they come from and times each benchmark is run (best run counts)
+static size_t requests = 15000;
+static size_t clients = 500;
+static int runs = 20;
+
+// body of active_requests reply the way squid sends it (CRLF, tab indented connection details)
+static string Reply(size_t count) {
+   static const char* users[] = { "-", "alice", "DOMAIN\\Bob", "carol@example.com" };
+   string reply;
+   char block[1024];
+   for (size_t i = 0; i < count; ++i) {
+      size_t client = (i * 7919) % clients;
+      double etime = static_cast<double>((i * 37) % 50000) / 1000 + 0.001;
+      snprintf(block, sizeof block,
+               "Connection: 0x%lx\r\n"
+               "\tFD %lu, read 3, wrote 4\r\n"
+               "\tFD desc: Reading next request\r\n"
+               "\tin: buf 0x0, used 0, free 4096\r\n"
+               "\tremote: 10.%lu.%lu.%lu:%lu\r\n"
+               "\tlocal: 10.0.0.1:3128\r\n"
+               "\tnrequests: 1\r\n"
+               "uri http://host%lu.example.com/path/%lu/file.bin\r\n"
+               "logType TCP_MISS\r\n"
+               "out.offset 0, out.size %lu\r\n"
+               "req_sz 345\r\n"
+               "entry 0x0/0\r\n"
+               "start 1300000000.000000 (%.6f seconds ago)\r\n"
+               "username %s\r\n"
+               "delay_pool %lu\r\n"
+               "\r\n",
+               0x55d0c8a3e2f8UL + i * 16, 10 + i, (client >> 16) & 255, (client >> 8) & 255, client & 255,
+               40000 + i % 20000, i % 97, i % 13, (i * 104729) % 50000000, etime, users[i % 4], i % 3);
+      reply += block;
+   }
+   return reply;
+}
+
+// FNV-1a
+static void Digest(uint64_t& digest, const void* data, size_t len) {
+   const unsigned char* bytes = static_cast<const unsigned char*>(data);
+   for (size_t i = 0; i < len; ++i) {
+      digest ^= bytes[i];
+      digest *= 1099511628211ULL;
+   }
+}
+
+static const char* scan_impls[] = { "scalar", "sse2", "avx2" };
+
+// random buffers of chars scanner looks for, each implementation has to find the same ones
+static bool ScanRandom() {
+   static const char alphabet[] = "ab \n\t\r\x01\x1e\x1f\x7f\x80\xff";
+   vector<char> buf(300);
+   unsigned int seed = 1;
+   for (int test = 0; test < 20000; ++test) {
+      size_t len = rand_r(&seed) % buf.size();
+      size_t start = rand_r(&seed) % 32;
+      if (start > len) start = len;
+      for (size_t i = 0; i < len; ++i)
+         buf[i] = alphabet[rand_r(&seed) % (sizeof(alphabet) - 1)];
+      const char* begin = &buf[0] + start;
+      const char* end = &buf[0] + len;
+      const char* byte = NULL;
+      const char* control = NULL;
+      for (size_t i = 0; i < sizeof(scan_impls)/sizeof(scan_impls[0]); ++i) {
+         if (!Scan::Use(scan_impls[i])) continue;
+         const char* found_byte = Scan::FindByte(begin, end, '\n');
+         const char* found_control = Scan::FindControl(begin, end);
+         if (byte == NULL) {
+            byte = found_byte;
+            control = found_control;
+         } else if ((found_byte != byte) || (found_control != control)) {
+            cerr << "scan: " << scan_impls[i] << " differs from scalar on random input " << test << endl;
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+// splits reply into lines and fields like sqconn::getline and sqstat::Line do (lines are stripped
+// in place), fields gets offset and length of every field
+static void ScanReply(vector<char>& buf, vector<uint32_t>& fields) {
+   char* start = &buf[0];
+   char* pos = start;
+   char* end = pos + buf.size();
+   Utils::StrRef parts[5];
+   fields.clear();
+   while (pos != end) {
+      char* nl = const_cast<char*>(Scan::FindByte(pos, end, '\n'));
+      char* line = Scan::SkipControl(pos, nl);
+      size_t len = Scan::StripControl(line, nl - line);
+      size_t count = Utils::SplitRef(Utils::StrRef(line, len), ' ', parts, 5);
+      for (size_t i = 0; i < count; ++i) {
+         fields.push_back(parts[i].data - start);
+         fields.push_back(parts[i].len);
+      }
+      pos = (nl != end) ? nl + 1 : end;
+   }
+}
+
+// only finds line ends, returns number of lines
+static size_t CountLines(const string& reply) {
+   const char* pos = reply.data();
+   const char* end = pos + reply.size();
+   size_t lines = 0;
+   while (pos != end) {
+      const char* nl = Scan::FindByte(pos, end, '\n');
+      lines++;
+      pos = (nl != end) ? nl + 1 : end;
+   }
+   return lines;
+}
+
+static bool BenchScan() {
+   string saved = Scan::Name();
+   if (!ScanRandom()) return false;
+   string reply = Reply(requests);
+   cout << "scan: " << requests << " requests, " << reply.size() / 1024 << " KB reply" << endl;
+   vector<char> buf;
+   vector<uint32_t> fields;
+   uint64_t digest = 0;
+   bool same = true;
+   for (size_t i = 0; i < sizeof(scan_impls)/sizeof(scan_impls[0]); ++i) {
+      if (!Scan::Use(scan_impls[i])) {
+         cout << "   " << scan_impls[i] << ": not supported by cpu" << endl;
+         continue;
+      }
+      long long best_lines = -1;
+      size_t lines = 0;
+      for (int run = 0; run < runs; ++run) {
+         long long start = Utils::MonotonicUs();
+         lines = CountLines(reply);
+         long long took = Utils::MonotonicUs() - start;
+         if ((best_lines < 0) || (took < best_lines)) best_lines = took;
+      }
+      long long best = -1;
+      for (int run = 0; run < runs; ++run) {
+         buf.assign(reply.begin(), reply.end());
+         long long start = Utils::MonotonicUs();
+         ScanReply(buf, fields);
+         long long took = Utils::MonotonicUs() - start;
+         if ((best < 0) || (took < best)) best = took;
+      }
+      uint64_t result = 14695981039346656037ULL;
+      Digest(result, &buf[0], buf.size());
+      Digest(result, &fields[0], fields.size() * sizeof(fields[0]));
+      Digest(result, &lines, sizeof lines);
+      if (digest == 0) digest = result;
+      same = same && (result == digest);
+      printf("   %-8s line ends %7lld us %6.0f MB/s, lines and fields %7lld us %6.0f MB/s%s\n", scan_impls[i],
+             best_lines, static_cast<double>(reply.size()) / std::max(best_lines, 1LL),
+             best, static_cast<double>(reply.size()) / std::max(best, 1LL), (result == digest) ? "" : "  DIFFERS");
+   }
+   Scan::Use(saved.c_str());
+   return same;
+}
+
+// requests of synthetic snapshot the way parser leaves them (same requests as in Reply):
+// connections in order their first request came, rows in order of reply
+struct Snapshot {
+   StringPool pool;
+   std::vector<SquidConnection> connections;
+   std::vector<UriStats> rows;
+   // connection of each row
+   std::vector<uint32_t> conns;
+};
+
+static void MakeSnapshot(Snapshot& snapshot, size_t hosts = clients) {
+   static const char* users[] = { "", "alice", "domain\\bob", "carol@example.com" };
+   vector<int> index(hosts, -1);
+   char text[128];
+   for (size_t i = 0; i < requests; ++i) {
+      size_t client = (i * 7919) % hosts;
+      if (index[client] < 0) {
+         index[client] = snapshot.connections.size();
+         SquidConnection conn;
+         snprintf(text, sizeof text, "10.%lu.%lu.%lu", (client >> 16) & 255, (client >> 8) & 255, client & 255);
+         conn.peer = snapshot.pool.Intern(text, strlen(text));
+         Utils::ParseIP(Utils::StrRef(text, strlen(text)), conn.addr);
+         snapshot.connections.push_back(conn);
+      }
+      SquidConnection& conn = snapshot.connections[index[client]];
+      snprintf(text, sizeof text, "0x%lx", 0x55d0c8a3e2f8UL + i * 16);
+      UriStats stats(snapshot.pool.Intern(text, strlen(text)));
+      snprintf(text, sizeof text, "http://host%lu.example.com/path/%lu/file.bin", i % 97, i % 13);
+      stats.uri = snapshot.pool.Intern(text, strlen(text));
+      stats.count = 1;
+      stats.size = (i * 104729) % 50000000;
+      stats.etime_ms = (i * 37) % 50000 + 1;
+      stats.etime = stats.etime_ms / 1000;
+      stats.curr_speed = (i * 7) % 100000;
+      stats.delay_pool = i % 3;
+      stats.username = snapshot.pool.Intern(users[i % 4], strlen(users[i % 4]));
+      stats.peer = conn.peer;
+      if (!stats.username.empty()) conn.usernames.insert(stats.username);
+      snapshot.rows.push_back(stats);
+      snapshot.conns.push_back(index[client]);
+   }
+}
+
+static void Best(long long& best, long long took) {
+   if ((best < 0) || (took < best)) best = took;
+}
+
+static bool BenchAggregate() {
+   Snapshot snapshot;
+   MakeSnapshot(snapshot);
+   cout << "aggregate: " << requests << " requests from " << snapshot.connections.size() << " clients" << endl;
+   long long vectors_add = -1, vectors_sum = -1, columns_add = -1, columns_sum = -1;
+   long long vectors_copy = -1, columns_copy = -1;
+   vector<SquidConnection> vectors, columns;
+   StatColumns stats, grouped;
+   long vectors_speed = 0, columns_speed = 0;
+   for (int run = 0; run < runs; ++run) {
+      // layout before columns: parser added request to vector of its connection and summed
+      // size and time on the way, then speeds were computed per connection and connections sorted
+      vectors = snapshot.connections;
+      long long start = Utils::MonotonicUs();
+      for (size_t row = 0; row < snapshot.rows.size(); ++row) {
+         const UriStats& request = snapshot.rows[row];
+         SquidConnection& conn = vectors[snapshot.conns[row]];
+         conn.sum_size += request.size;
+         if (request.etime > conn.max_etime)
+            conn.max_etime = request.etime;
+         conn.stats.push_back(request);
+      }
+      long long added = Utils::MonotonicUs();
+      vectors_speed = 0;
+      for (vector<SquidConnection>::iterator Conn = vectors.begin(); Conn != vectors.end(); ++Conn) {
+         for (vector<UriStats>::iterator Stats = Conn->stats.begin(); Stats != Conn->stats.end(); ++Stats) {
+            if ((Stats->size != 0) && (Stats->etime_ms != 0)) {
+               Stats->av_speed = Stats->size*1000/Stats->etime_ms;
+               Conn->av_speed += Stats->av_speed;
+               vectors_speed += Stats->av_speed;
+            }
+         }
+      }
+      sort(vectors.begin(), vectors.end(), sqstat::CompareIP);
+      long long end = Utils::MonotonicUs();
+      Best(vectors_add, added - start);
+      Best(vectors_sum, end - added);
+
+      // what sqstat does now
+      // sqstat reuses its parse columns, columns of snapshot are new every time
+      columns = snapshot.connections;
+      stats.Clear();
+      StatColumns fresh;
+      grouped.Swap(fresh);
+      start = Utils::MonotonicUs();
+      for (size_t row = 0; row < snapshot.rows.size(); ++row)
+         stats.Append(snapshot.rows[row], snapshot.conns[row]);
+      added = Utils::MonotonicUs();
+      columns_speed = sqstat::GroupStats(columns, stats, grouped);
+      end = Utils::MonotonicUs();
+      Best(columns_add, added - start);
+      Best(columns_sum, end - added);
+
+      // ncui copies connections of snapshot on every redraw
+      start = Utils::MonotonicUs();
+      vector<SquidConnection> copy(vectors);
+      Best(vectors_copy, Utils::MonotonicUs() - start);
+      start = Utils::MonotonicUs();
+      vector<SquidConnection> other(columns);
+      Best(columns_copy, Utils::MonotonicUs() - start);
+   }
+   printf("   %-8s adding requests %6lld us, speeds, sums and order %6lld us, total %6lld us; copy %6lld us\n",
+          "vectors", vectors_add, vectors_sum, vectors_add + vectors_sum, vectors_copy);
+   printf("   %-8s adding requests %6lld us, speeds, sums and order %6lld us, total %6lld us; copy %6lld us\n",
+          "columns", columns_add, columns_sum, columns_add + columns_sum, columns_copy);
+
+   bool same = (vectors_speed == columns_speed) && (vectors.size() == columns.size());
+   for (size_t index = 0; same && (index < vectors.size()); ++index) {
+      const SquidConnection& a = vectors[index];
+      const SquidConnection& b = columns[index];
+      same = (a.addr == b.addr) && (a.sum_size == b.sum_size) && (a.av_speed == b.av_speed) &&
+             (a.max_etime == b.max_etime) && (a.stats.size() == b.stats_count);
+      for (size_t row = 0; same && (row < a.stats.size()); ++row) {
+         const UriStats& request = a.stats[row];
+         size_t other = b.first_stat + row;
+         same = (request.id == grouped.id[other]) && (request.size == grouped.size[other]) &&
+                (request.av_speed == grouped.av_speed[other]) && (grouped.conn[other] == index);
+      }
+   }
+   return same;
+}
+
+static const Options::RATE_WINDOW rate_windows[] = { Options::RATE_LAST, Options::RATE_5S, Options::RATE_30S,
+                                                     Options::RATE_60S, Options::RATE_EWMA };
+static const char* rate_names[] = { "last", "5s", "30s", "60s", "ewma" };
+
+static bool BenchRate() {
+   // one meter per request, fetched every second for two minutes
+   const int fetches = 120;
+   const long long interval = 1000;
+   const size_t windows = sizeof(rate_windows)/sizeof(rate_windows[0]);
+   cout << "rate: " << requests << " meters, " << fetches << " samples each" << endl;
+   vector<RateMeter> meters(requests);
+   // what curr_speed was before meters: difference to previous fetch
+   vector<long long> previous(requests);
+   vector<long> delta(requests);
+   long long add_first = 0, add_last = 0, add_total = 0, read_total = 0, delta_total = 0;
+   bool same = true;
+   for (int fetch = 1; fetch <= fetches; ++fetch) {
+      long long stamp = fetch * interval;
+      long long start = Utils::MonotonicUs();
+      for (size_t i = 0; i < requests; ++i)
+         meters[i].Add(stamp, (i % 100 + 1) * 1000 * fetch);
+      long long took = Utils::MonotonicUs() - start;
+      add_total += took;
+      if (fetch <= 10) add_first += took;
+      if (fetch > fetches - 10) add_last += took;
+
+      start = Utils::MonotonicUs();
+      for (size_t i = 0; i < requests; ++i) {
+         long long bytes = (i % 100 + 1) * 1000 * fetch;
+         delta[i] = (fetch > 1) ? (bytes - previous[i]) * 1000 / interval : 0;
+         previous[i] = bytes;
+      }
+      delta_total += Utils::MonotonicUs() - start;
+
+      // every request moves at steady rate, so every window has to give it exactly
+      long sum = 0;
+      start = Utils::MonotonicUs();
+      for (size_t i = 0; i < requests; ++i) {
+         for (size_t w = 0; w < windows; ++w)
+            sum += meters[i].Rate(rate_windows[w]);
+      }
+      read_total += Utils::MonotonicUs() - start;
+      long expected = 0;
+      for (size_t i = 0; (fetch > 1) && (i < requests); ++i)
+         expected += delta[i] * windows;
+      same = same && (sum == expected);
+   }
+   double samples = static_cast<double>(requests) * fetches;
+   printf("   %-30s %6.1f ns per sample\n", "difference to previous fetch", delta_total * 1000 / samples);
+   printf("   %-30s %6.1f ns per sample, first 10 fetches %.1f ns, last 10 %.1f ns\n", "RateMeter::Add",
+          add_total * 1000 / samples, add_first * 1000 / (requests * 10.0), add_last * 1000 / (requests * 10.0));
+   printf("   %-30s %6.1f ns per window\n", "RateMeter::Rate", read_total * 1000 / (samples * windows));
+
+   // request that gets 2 MB every other second: rate each window gives over last minute
+   RateMeter bursty;
+   long long bytes = 0;
+   long low[windows], high[windows];
+   for (int fetch = 1; fetch <= fetches; ++fetch) {
+      if (fetch % 2 == 0) bytes += 2000000;
+      bursty.Add(fetch * interval, bytes);
+      for (size_t w = 0; (fetch > fetches - 60) && (w < windows); ++w) {
+         long rate = bursty.Rate(rate_windows[w]);
+         if ((fetch == fetches - 59) || (rate < low[w])) low[w] = rate;
+         if ((fetch == fetches - 59) || (rate > high[w])) high[w] = rate;
+      }
+   }
+   cout << "   2 MB every other second, range of rate over last minute:" << endl;
+   for (size_t w = 0; w < windows; ++w)
+      printf("      %-5s %8ld .. %8ld\n", rate_names[w], low[w], high[w]);
+   return same;
+}
+
+// what ordering by keys was before Sort: comparator over connections, keys compared one by one
+struct KeysLess {
+   const vector<Options::SortKey>& keys;
+   KeysLess(const vector<Options::SortKey>& keys) : keys(keys) {};
+   // <0, 0 or >0 like strcmp, in ascending order of key
+   static int Compare(const SquidConnection& a, const SquidConnection& b, Options::SORT_ORDER order) {
+      switch (order) {
+         case Options::SORT_SIZE:
+            return (a.sum_size < b.sum_size) ? -1 : (a.sum_size > b.sum_size);
+         case Options::SORT_CURRENT_SPEED:
+            return (a.curr_speed < b.curr_speed) ? -1 : (a.curr_speed > b.curr_speed);
+         case Options::SORT_AVERAGE_SPEED:
+            return (a.av_speed < b.av_speed) ? -1 : (a.av_speed > b.av_speed);
+         case Options::SORT_MAX_TIME:
+            return (a.max_etime < b.max_etime) ? -1 : (a.max_etime > b.max_etime);
+         case Options::SORT_IP:
+            return (a.addr < b.addr) ? -1 : (b.addr < a.addr);
+         case Options::SORT_USER:
+            // connections without user go after all users
+            if (a.usernames.empty() || b.usernames.empty())
+               return a.usernames.empty() - b.usernames.empty();
+            return (*a.usernames.begin() < *b.usernames.begin()) ? -1 : (*b.usernames.begin() < *a.usernames.begin());
+         case Options::SORT_REQUESTS:
+            return (a.stats_count < b.stats_count) ? -1 : (a.stats_count > b.stats_count);
+      }
+      return 0;
+   }
+   bool operator () (const SquidConnection* a, const SquidConnection* b) const {
+      for (vector<Options::SortKey>::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+         int result = Compare(*a, *b, it->order);
+         if (result != 0) return it->ascending ? (result < 0) : (result > 0);
+      }
+      return false;
+   }
+};
+
+// connections with keys in small ranges, so that there are many ties for next keys to break
+static void MakeConnections(StringPool& pool, vector<SquidConnection>& connections) {
+   static const char* users[] = { "alice", "domain\\bob", "carol@example.com", "dave", "eve" };
+   vector<Atom> atoms;
+   for (size_t i = 0; i < sizeof(users)/sizeof(users[0]); ++i)
+      atoms.push_back(pool.Intern(users[i], strlen(users[i])));
+   connections.resize(requests);
+   unsigned int seed = 1;
+   for (size_t i = 0; i < requests; ++i) {
+      SquidConnection& conn = connections[i];
+      conn.addr = Utils::IPAddr(0, (0xffffULL << 32) | (0x0a000000 + rand_r(&seed) % (requests * 4)));
+      conn.sum_size = (rand_r(&seed) % 1000) * 1024;
+      conn.curr_speed = rand_r(&seed) % 50 * 1000;
+      conn.av_speed = rand_r(&seed) % 100000;
+      conn.max_etime = rand_r(&seed) % 600;
+      conn.stats_count = rand_r(&seed) % 20 + 1;
+      size_t user = rand_r(&seed) % (atoms.size() + 1);
+      if (user < atoms.size()) conn.usernames.insert(atoms[user]);
+   }
+}
+
+static bool BenchSort() {
+   static const char* specs[] = { "size", "speed,+ip", "user,time,requests", "-ip", "avspeed,-user,ip" };
+   const size_t top = 50;
+   StringPool pool;
+   vector<SquidConnection> connections;
+   MakeConnections(pool, connections);
+   vector<const SquidConnection*> conns(connections.size());
+   for (size_t i = 0; i < connections.size(); ++i)
+      conns[i] = &connections[i];
+   cout << "sort: " << conns.size() << " connections, top is first " << top << " of them" << endl;
+   bool same = true;
+   for (size_t s = 0; s < sizeof(specs)/sizeof(specs[0]); ++s) {
+      vector<Options::SortKey> keys = Sort::Parse(specs[s]);
+      long long radix = -1, compared = -1, heap = -1, partial = -1;
+      vector<const SquidConnection*> sorted, reference, heap_top, partial_top;
+      for (int run = 0; run < runs; ++run) {
+         long long start = Utils::MonotonicUs();
+         sorted = Sort::Top(conns, keys);
+         Best(radix, Utils::MonotonicUs() - start);
+
+         reference = conns;
+         start = Utils::MonotonicUs();
+         std::stable_sort(reference.begin(), reference.end(), KeysLess(keys));
+         Best(compared, Utils::MonotonicUs() - start);
+
+         start = Utils::MonotonicUs();
+         heap_top = Sort::Top(conns, keys, top);
+         Best(heap, Utils::MonotonicUs() - start);
+
+         // partial_sort is not stable, so only time of it is compared
+         partial_top = conns;
+         start = Utils::MonotonicUs();
+         std::partial_sort(partial_top.begin(), partial_top.begin() + std::min(top, partial_top.size()),
+                           partial_top.end(), KeysLess(keys));
+         Best(partial, Utils::MonotonicUs() - start);
+      }
+      // equal connections have to keep their order, or they would flicker between refreshes
+      bool ok = (sorted == reference) &&
+                (heap_top == vector<const SquidConnection*>(sorted.begin(), sorted.begin() + heap_top.size())) &&
+                (heap_top.size() == std::min(top, sorted.size()));
+      same = same && ok;
+      printf("   %-20s Sort::Top %6lld us, stable_sort %6lld us; top: Sort::Top %6lld us, partial_sort %6lld us%s\n",
+             specs[s], radix, compared, heap, partial, ok ? "" : "  DIFFERS");
+   }
+   return same;
+}
+
+// what merging of same urls was before UrlCompactor: map of url to merged request for every connection
+static void MapCompact(SquidConnection& conn, size_t top) {
+   std::map<Atom, UriStats> urls;
+   for (vector<UriStats>::iterator itu = conn.stats.begin(); itu != conn.stats.end(); ++itu) {
+      Atom url = itu->uri;
+      if (urls.find(url) == urls.end()) {
+         urls[url] = *itu;
+      } else {
+         urls[url].count += 1;
+         urls[url].size += itu->size;
+         urls[url].etime += itu->etime;
+         urls[url].etime_ms += itu->etime_ms;
+         if ((urls[url].size != 0) && (urls[url].etime_ms != 0))
+            urls[url].av_speed = urls[url].size*1000/urls[url].etime_ms;
+      }
+   }
+   conn.stats.clear();
+   for (std::map<Atom, UriStats>::iterator itm = urls.begin(); itm != urls.end(); ++itm)
+      conn.stats.push_back(itm->second);
+   if (top < conn.stats.size())
+      std::partial_sort(conn.stats.begin(), conn.stats.begin() + top, conn.stats.end(), sqstat::CompareURLs);
+   else
+      sort(conn.stats.begin(), conn.stats.end(), sqstat::CompareURLs);
+}
+
+static bool UriLess(const UriStats& a, const UriStats& b) {
+   return a.uri.str() < b.uri.str();
+}
+
+// both ways have to merge the same requests, sizes of first top urls have to be the same
+// (urls of the same size may come in any order)
+static bool SameCompacted(vector<UriStats> a, vector<UriStats> b, size_t top) {
+   if (a.size() != b.size()) return false;
+   for (size_t i = 0; i < std::min(top, a.size()); ++i) {
+      if (a[i].size != b[i].size) return false;
+   }
+   sort(a.begin(), a.end(), UriLess);
+   sort(b.begin(), b.end(), UriLess);
+   for (size_t i = 0; i < a.size(); ++i) {
+      if ((a[i].uri != b[i].uri) || (a[i].id != b[i].id) || (a[i].count != b[i].count) || (a[i].size != b[i].size) ||
+          (a[i].etime != b[i].etime) || (a[i].etime_ms != b[i].etime_ms) || (a[i].av_speed != b[i].av_speed) ||
+          (a[i].username != b[i].username))
+         return false;
+   }
+   return true;
+}
+
+static bool BenchCompact() {
+   // ncui compacts only visible rows, sqtop -o all of them
+   static const size_t tops[] = { 20, SIZE_MAX };
+   bool same = true;
+   // requests from many clients to different urls, and from few clients downloading
+   // the same files in segments
+   for (int shape = 0; shape < 2; ++shape) {
+      Snapshot snapshot;
+      MakeSnapshot(snapshot, shape ? std::max(clients / 50, static_cast<size_t>(1)) : clients);
+      char text[128];
+      for (size_t row = 0; shape && (row < snapshot.rows.size()); ++row) {
+         snprintf(text, sizeof text, "http://cdn.example.com/video/%lu.mp4", row % 7);
+         snapshot.rows[row].uri = snapshot.pool.Intern(text, strlen(text));
+      }
+      StatColumns stats, grouped;
+      for (size_t row = 0; row < snapshot.rows.size(); ++row)
+         stats.Append(snapshot.rows[row], snapshot.conns[row]);
+      sqstat::GroupStats(snapshot.connections, stats, grouped);
+      vector<SquidConnection>& filled = snapshot.connections;
+      size_t urls = 0;
+      for (size_t index = 0; index < filled.size(); ++index) {
+         grouped.Fill(filled[index]);
+         UrlCompactor().Compact(filled[index]);
+         urls += filled[index].stats.size();
+         grouped.Fill(filled[index]);
+      }
+      cout << "compact: " << requests << " requests from " << filled.size() << " clients to " << urls << " urls" << endl;
+
+      for (size_t t = 0; t < sizeof(tops)/sizeof(tops[0]); ++t) {
+         size_t top = tops[t];
+         long long mapped = -1, hashed = -1;
+         vector<SquidConnection> old_way, new_way;
+         UrlCompactor compactor;
+         for (int run = 0; run < runs; ++run) {
+            old_way = filled;
+            long long start = Utils::MonotonicUs();
+            for (size_t index = 0; index < old_way.size(); ++index)
+               MapCompact(old_way[index], top);
+            Best(mapped, Utils::MonotonicUs() - start);
+
+            new_way = filled;
+            start = Utils::MonotonicUs();
+            for (size_t index = 0; index < new_way.size(); ++index)
+               compactor.Compact(new_way[index], top);
+            Best(hashed, Utils::MonotonicUs() - start);
+         }
+         bool ok = true;
+         for (size_t index = 0; ok && (index < old_way.size()); ++index)
+            ok = SameCompacted(old_way[index].stats, new_way[index].stats, top);
+         same = same && ok;
+         char name[32];
+         if (top == SIZE_MAX)
+            snprintf(name, sizeof name, "all urls");
+         else
+            snprintf(name, sizeof name, "top %lu urls", top);
+         printf("   %-12s map %6lld us, UrlCompactor %6lld us%s\n", name, mapped, hashed, ok ? "" : "  DIFFERS");
+      }
+   }
+   return same;
+}
+
+// totals of group
+struct Totals {
+   size_t requests;
+   long long size;
+   long av_speed;
+   long curr_speed;
+   long max_etime;
+   Totals() : requests(0), size(0), av_speed(0), curr_speed(0), max_etime(0) {};
+   void Add(const StatColumns& stats, size_t row) {
+      requests++;
+      size += stats.size[row];
+      av_speed += stats.av_speed[row];
+      curr_speed += stats.curr_speed[row];
+      max_etime = std::max(max_etime, stats.etime[row]);
+   }
+   bool operator == (const Totals& other) const {
+      return (requests == other.requests) && (size == other.size) && (av_speed == other.av_speed) &&
+             (curr_speed == other.curr_speed) && (max_etime == other.max_etime);
+   }
+};
+
+// straightforward grouping by user or delay pool: map of group name to totals, looked up for every request
+static void MapGroup(const StatColumns& stats, Options::GROUP_BY by, bool strip_user_domain,
+                     std::map<string, Totals>& groups) {
+   for (size_t row = 0; row < stats.Size(); ++row) {
+      string name;
+      if (by == Options::GROUP_USER) {
+         name = stats.username[row];
+         if (name.empty())
+            name = "-";
+         else if (strip_user_domain)
+            name = Utils::StripUserDomain(name);
+      } else {
+         name = Utils::itos(stats.delay_pool[row]);
+      }
+      groups[name].Add(stats, row);
+   }
+}
+
+static bool BenchGroup() {
+   static const Options::GROUP_BY views[] = { Options::GROUP_USER, Options::GROUP_USER, Options::GROUP_DELAY_POOL,
+                                              Options::GROUP_SUBNET, Options::GROUP_DOMAIN };
+   static const char* view_names[] = { "user", "user -Z", "delay pool", "subnet", "domain" };
+   Snapshot snapshot;
+   MakeSnapshot(snapshot);
+   SquidStats in;
+   StatColumns stats;
+   for (size_t row = 0; row < snapshot.rows.size(); ++row)
+      stats.Append(snapshot.rows[row], snapshot.conns[row]);
+   sqstat::GroupStats(snapshot.connections, stats, in.stats);
+   in.connections.swap(snapshot.connections);
+   Totals total;
+   for (size_t row = 0; row < in.stats.Size(); ++row)
+      total.Add(in.stats, row);
+   cout << "group: " << in.stats.Size() << " requests from " << in.connections.size() << " clients" << endl;
+
+   bool same = true;
+   for (size_t v = 0; v < sizeof(views)/sizeof(views[0]); ++v) {
+      Options::GROUP_BY by = views[v];
+      bool strip_user_domain = (v == 0);
+      bool tree = (by == Options::GROUP_SUBNET) || (by == Options::GROUP_DOMAIN);
+      long long grouped = -1, mapped = -1;
+      SquidStats out;
+      std::map<string, Totals> groups;
+      for (int run = 0; run < runs; ++run) {
+         long long start = Utils::MonotonicUs();
+         Pivot::Group(in, by, strip_user_domain, out);
+         Best(grouped, Utils::MonotonicUs() - start);
+         if (!tree) {
+            groups.clear();
+            start = Utils::MonotonicUs();
+            MapGroup(in.stats, by, strip_user_domain, groups);
+            Best(mapped, Utils::MonotonicUs() - start);
+         }
+      }
+
+      // every request is in exactly one group, sums of group have to be those of its requests,
+      // the same as map gives for its name; in trees totals of top level ones have to add up
+      Totals sum;
+      size_t top_level = 0;
+      bool ok = (out.stats.Size() == in.stats.Size());
+      for (size_t index = 0; ok && (index < out.connections.size()); ++index) {
+         const SquidConnection& conn = out.connections[index];
+         Totals own;
+         for (size_t row = conn.first_stat; row < conn.first_stat + conn.stats_count; ++row) {
+            own.Add(out.stats, row);
+            ok = ok && (out.stats.conn[row] == index);
+         }
+         // hosts of subnet view have no peers, they are clients themselves
+         ok = ok && (conn.peers.size() <= in.connections.size()) && (!conn.peers.empty() || (conn.depth == SUBNET_LEVELS));
+         if (conn.depth != 0) continue;
+         top_level++;
+         if (tree) {
+            // subnets sum totals of hosts, which may differ from sums of requests in speeds
+            own.requests = conn.tree_count;
+            own.size = conn.sum_size;
+            if (by == Options::GROUP_DOMAIN) {
+               own.av_speed = conn.av_speed;
+               own.curr_speed = conn.curr_speed;
+               own.max_etime = conn.max_etime;
+            }
+         } else {
+            ok = ok && !conn.peers.empty() && (own.size == conn.sum_size) && (own.av_speed == conn.av_speed) &&
+                 (own.curr_speed == conn.curr_speed) && (own.max_etime == conn.max_etime) &&
+                 (groups.count(conn.peer) == 1) && (groups[conn.peer] == own);
+         }
+         sum.requests += own.requests;
+         sum.size += own.size;
+         sum.av_speed += own.av_speed;
+         sum.curr_speed += own.curr_speed;
+         sum.max_etime = std::max(sum.max_etime, own.max_etime);
+      }
+      if (by == Options::GROUP_SUBNET)
+         ok = ok && (sum.requests == total.requests) && (sum.size == total.size);
+      else
+         ok = ok && (sum == total) && (tree || (top_level == groups.size()));
+      same = same && ok;
+      printf("   %-10s %5lu groups, %5lu top level, Pivot::Group %6lld us", view_names[v], out.connections.size(),
+             top_level, grouped);
+      if (!tree)
+         printf(", map of names %6lld us", mapped);
+      printf("%s\n", ok ? "" : "  DIFFERS");
+   }
+   return same;
+}
+
+struct Benchmark {
+   const char* name;
+   bool (*run)();
+   const char* description;
+};
+
+static const Benchmark benchmarks[] = {
+   { "scan", BenchScan, "line and field splitting of reply with each Scan implementation" },
+   { "aggregate", BenchAggregate, "speeds, sums and grouping of requests and copying connections, in columns and in vectors" },
+   { "rate", BenchRate, "windowed rate meters against difference to previous fetch" },
+   { "sort", BenchSort, "ordering of connections (one per request) by keys, radix sort against comparator" },
+   { "compact", BenchCompact, "merging requests of connection to the same url, hash index against map" },
+   { "group", BenchGroup, "grouping of requests by user and delay pool against map of group names, subnets and domains" }
+};
+
+static void usage(char* argv) {
+   cout << "Usage: " << argv << " [-n requests] [-c clients] [-r runs] [benchmark...]" << endl;
+   cout << "Runs all benchmarks if none is given:" << endl;
+   for (size_t i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]); ++i)
+      printf("   %-10s %s\n", benchmarks[i].name, benchmarks[i].description);
+}
+
+int main(int argc, char **argv) {
+   int ch;
+   while ((ch = getopt(argc, argv, "n:c:r:h")) != -1) {
+      switch (ch) {
+         case 'n':
+            requests = std::max(atol(optarg), 1L);
+            break;
+         case 'c':
+            clients = std::max(atol(optarg), 1L);
+            break;
+         case 'r':
+            runs = std::max(atoi(optarg), 1);
+            break;
+         default:
+            usage(argv[0]);
+            return (ch == 'h') ? 0 : 1;
+      }
+   }
+   vector<string> names(argv + optind, argv + argc);
+   if (names.empty()) {
+      for (size_t i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]); ++i)
+         names.push_back(benchmarks[i].name);
+   }
+   bool ok = true;
+   for (size_t n = 0; n < names.size(); ++n) {
+      size_t i = 0;
+      while ((i < sizeof(benchmarks)/sizeof(benchmarks[0])) && (names[n] != benchmarks[i].name)) ++i;
+      if (i == sizeof(benchmarks)/sizeof(benchmarks[0])) {
+         cerr << "Unknown benchmark - '" << names[n] << "'" << endl;
+         usage(argv[0]);
+         return 1;
+      }
+      if (!benchmarks[i].run()) {
+         cerr << names[n] << ": results differ" << endl;
+         ok = false;
+      }
+   }
+   return ok ? 0 : 1;
+}
+
+// vim: ai ts=3 sts=3 et sw=3 expandtab
@@ -7,71 +7,506 @@
 #include <cerrno>
 //strerror
 #include <cstring>
-//gethostbyname, h_errno
+//strtoull
+#include <cstdlib>
+//getaddrinfo
 #include <netdb.h>
 //socket, connect
 #include <sys/socket.h>
-//write, read, close
+//write, read, close, pipe
 #include <unistd.h>
+//fcntl
+#include <fcntl.h>
+//poll
+#include <poll.h>
 
 #include "sqconn.hpp"
+#include "Utils.hpp"
+#include "Scan.hpp"
 
 using std::string;
 
 namespace sqtop {
 
-sqconn::sqconn() {
+sqconn::sqconn() : m_buf(SQCONN_BUFSIZE) {
     m_sock=0;
+    m_port=0;
+    m_addrs_port = 0;
+    m_addrs_expire = 0;
+    m_lookups = 0;
+    m_connect_timeout = m_fetch_timeout = 0;
+    m_connect_deadline = m_fetch_deadline = 0;
+    m_cancelled = 0;
+    if (pipe(m_cancel_pipe) == 0) {
+       fcntl(m_cancel_pipe[1], F_SETFL, fcntl(m_cancel_pipe[1], F_GETFL) | O_NONBLOCK);
+    } else {
+       m_cancel_pipe[0] = m_cancel_pipe[1] = -1;
+    }
+    reset();
 }
 
 sqconn::~sqconn() {
+    close();
+    if (m_cancel_pipe[0] >= 0) {
+       ::close(m_cancel_pipe[0]);
+       ::close(m_cancel_pipe[1]);
+    }
+}
+
+void sqconn::set_deadlines(long connect_ms, long fetch_ms) {
+    m_connect_timeout = connect_ms;
+    m_fetch_timeout = fetch_ms;
+    m_fetch_deadline = (fetch_ms > 0) ? Utils::MonotonicMs() + fetch_ms : 0;
+}
+
+void sqconn::cancel() {
+    m_cancelled = 1;
+    if (m_cancel_pipe[1] >= 0) {
+       char ch = 0;
+       if (write(m_cancel_pipe[1], &ch, 1) < 0) {
+          // pipe is full - poll() will be woken up anyway
+       }
+    }
+}
+
+// polls fds (cancel pipe is added internally) until any of them is ready or
+// wake_at (ms, 0 - never) is reached. Throws on cancel or expired deadline.
+void sqconn::poll_wait(std::vector<struct pollfd>& fds, bool connecting, long long wake_at) {
+    size_t nfds = fds.size();
+    if (m_cancel_pipe[0] >= 0) {
+       struct pollfd pfd;
+       pfd.fd = m_cancel_pipe[0];
+       pfd.events = POLLIN;
+       fds.push_back(pfd);
+    }
+    while (true) {
+       if (m_cancelled) throw sqconnCancelled();
+
+       long long deadline = m_fetch_deadline;
+       bool connect_deadline = false;
+       if (connecting && m_connect_deadline &&
+           ((deadline == 0) || (m_connect_deadline < deadline))) {
+          deadline = m_connect_deadline;
+          connect_deadline = true;
+       }
+       long long now = Utils::MonotonicMs();
+       if ((deadline != 0) && (now >= deadline)) {
+          std::string what = connect_deadline ? "connect" : "fetch";
+          long limit = connect_deadline ? m_connect_timeout : m_fetch_timeout;
+          throw sqconnTimeout(what + " timed out after " + Utils::itos(limit) + " ms");
+       }
+       if ((wake_at != 0) && (now >= wake_at)) break;
+
+       long long until = deadline;
+       if ((wake_at != 0) && ((until == 0) || (wake_at < until))) until = wake_at;
+       int timeout = (until != 0) ? until - now : -1;
+       if (m_cancel_pipe[0] < 0) {
+          // no self-pipe, check cancel flag periodically
+          if ((timeout < 0) || (timeout > 100)) timeout = 100;
+       }
+       for (size_t i = 0; i < fds.size(); ++i) fds[i].revents = 0;
+       int ready = poll(&fds[0], fds.size(), timeout);
+       if (ready < 0) {
+          if (errno == EINTR) continue;
+          throw sqconnException(strerror(errno));
+       }
+       if (m_cancelled) throw sqconnCancelled();
+       bool any = false;
+       for (size_t i = 0; i < nfds; ++i) {
+          if (fds[i].revents != 0) any = true;
+       }
+       if (any) break;
+    }
+    fds.resize(nfds);
+}
+
+void sqconn::wait(short events, bool connecting) {
+    std::vector<struct pollfd> fds(1);
+    fds[0].fd = m_sock;
+    fds[0].events = events;
+    poll_wait(fds, connecting, 0);
+}
+
+void sqconn::reset() {
+    m_pos = m_avail = m_raw = m_end = 0;
+    m_eof = false;
+    m_body_mode = BODY_EOF;
+    m_body_done = false;
+    m_body_left = 0;
+    m_chunk_crlf = false;
+    m_chunk_trailers = false;
+    m_keepalive = false;
+    m_headers.clear();
+    m_reads = 0;
+    m_bytes = 0;
+    m_io_us = 0;
+}
+
+void sqconn::close() {
     if (m_sock != 0) {
        shutdown(m_sock,0);
-       close(m_sock);
+       ::close(m_sock);
+       m_sock = 0;
+    }
+}
+
+void sqconn::resolve(const string& server, int port) {
+    long long now = Utils::MonotonicMs();
+    if (!m_addrs.empty() && (m_addrs_host == server) && (m_addrs_port == port) &&
+        (now < m_addrs_expire)) {
+       return;
+    }
+    m_addrs.clear();
+
+    struct addrinfo hints;
+    struct addrinfo* res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_NUMERICSERV;
+    m_lookups++;
+    int err = getaddrinfo(server.c_str(), Utils::itos(port).c_str(), &hints, &res);
+    if (err != 0) {
+       throw sqconnException(gai_strerror(err));
     }
+    for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+       if (ai->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+       sqaddr addr;
+       memcpy(&addr.ss, ai->ai_addr, ai->ai_addrlen);
+       addr.len = ai->ai_addrlen;
+       m_addrs.push_back(addr);
+    }
+    freeaddrinfo(res);
+    if (m_addrs.empty()) {
+       throw sqconnException("No usable address for " + server);
+    }
+    m_addrs_host = server;
+    m_addrs_port = port;
+    m_addrs_expire = now + SQCONN_ADDR_TTL*1000;
+}
+
+// starts non-blocking connect, returns socket (-1 on immediate failure, errno is set)
+// and sets rDone if connection was established immediately
+static int start_connect(const struct sockaddr* addr, socklen_t len, bool& rDone) {
+    rDone = false;
+    int sock = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) return -1;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    if (connect(sock, addr, len) == 0) {
+       rDone = true;
+    } else if (errno != EINPROGRESS) {
+       int err = errno;
+       ::close(sock);
+       errno = err;
+       return -1;
+    }
+    return sock;
 }
 
 void sqconn::open(string server, int port) {
-    struct hostent* he;
+    close();
+    reset();
+    m_host = server;
+    m_port = port;
+
+    if (m_cancelled) throw sqconnCancelled();
+    m_connect_deadline = (m_connect_timeout > 0) ? Utils::MonotonicMs() + m_connect_timeout : 0;
+
+    resolve(server, port);
+
+    // try addresses in order, starting next attempt in parallel if previous one
+    // did not complete within SQCONN_FALLBACK_DELAY ms ("Happy Eyeballs", RFC 8305)
+    std::vector<struct pollfd> pending;
+    size_t next = 0;
+    long long next_start = 0;
+    int last_error = 0;
+    try {
+       while (m_sock == 0) {
+          long long now = Utils::MonotonicMs();
+          if ((next < m_addrs.size()) && (pending.empty() || (now >= next_start))) {
+             bool done;
+             int sock = start_connect((struct sockaddr*)&m_addrs[next].ss, m_addrs[next].len, done);
+             next++;
+             if (sock < 0) {
+                last_error = errno;
+             } else if (done) {
+                m_sock = sock;
+             } else {
+                struct pollfd pfd;
+                pfd.fd = sock;
+                pfd.events = POLLOUT;
+                pending.push_back(pfd);
+                next_start = now + SQCONN_FALLBACK_DELAY;
+             }
+             continue;
+          }
+          if (pending.empty()) break;
 
-    m_sock = socket(AF_INET, SOCK_STREAM, 6);
-    if(m_sock < 0) throw sqconnException(strerror(errno));
-    memset(&m_addr, 0, sizeof(struct sockaddr_in));
-    m_addr.sin_family = AF_INET;
-    m_addr.sin_port = htons(port);
-    he=gethostbyname(server.c_str());
-    if (he==NULL) throw sqconnException(hstrerror(h_errno));
-    m_addr.sin_addr = *(struct in_addr *) he->h_addr;
-    if (connect(m_sock, (struct sockaddr *)&m_addr, sizeof(m_addr)) < 0) {
-         close(m_sock);
-         throw sqconnException(strerror(errno));
+          poll_wait(pending, true, (next < m_addrs.size()) ? next_start : 0);
+          for (size_t i = 0; i < pending.size(); ) {
+             if (pending[i].revents == 0) {
+                ++i;
+                continue;
+             }
+             int err = 0;
+             socklen_t len = sizeof(err);
+             if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                err = errno;
+             if ((err == 0) && (m_sock == 0)) {
+                m_sock = pending[i].fd;
+             } else {
+                if (err != 0) last_error = err;
+                ::close(pending[i].fd);
+                // do not wait for fallback delay after failure
+                next_start = 0;
+             }
+             pending.erase(pending.begin() + i);
+          }
+       }
+    } catch (sqconnException &e) {
+       for (size_t i = 0; i < pending.size(); ++i) ::close(pending[i].fd);
+       throw;
+    }
+    for (size_t i = 0; i < pending.size(); ++i) ::close(pending[i].fd);
+
+    if (m_sock == 0) {
+       // addresses might have changed, resolve again next time
+       m_addrs.clear();
+       throw sqconnException(strerror(last_error ? last_error : ECONNREFUSED));
     }
 }
 
 int sqconn::operator << (const string str) {
-    int f = write(m_sock, str.c_str(), str.size());
-    if (f == -1) {
-       throw sqconnException(strerror(errno));
+    string data = str + "\x0D\x0A";
+    size_t sent = 0;
+    while (sent < data.size()) {
+#ifdef MSG_NOSIGNAL
+       ssize_t f = send(m_sock, data.c_str() + sent, data.size() - sent, MSG_NOSIGNAL);
+#else
+       ssize_t f = write(m_sock, data.c_str() + sent, data.size() - sent);
+#endif
+       if (f == -1) {
+          if (errno == EINTR) continue;
+          if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+             wait(POLLOUT, false);
+             continue;
+          }
+          throw sqconnException(strerror(errno));
+       }
+       sent += f;
     }
-    int s = write(m_sock, "\x0D\x0A", 2);
-    if (s == -1) {
-       throw sqconnException(strerror(errno));
-    }
-    return f+s;
+    return sent;
 }
 
 int sqconn::operator >> (string& rResult) {
-    char ch;
-    int data;
-    rResult="";
-    data = read(m_sock, &ch, 1);
-    while ((data!=0) && (data!=-1)) {
-          if (ch>30) rResult.push_back(ch);
-          if (ch==10) break;
-          data = read(m_sock, &ch, 1);
-    }
-    if (data == -1) throw sqconnException(strerror(errno));
-    return data;
+    const char* line;
+    size_t len;
+    if (!getline(line, len)) {
+       rResult="";
+       return 0;
+    }
+    rResult.assign(line, len);
+    return 1;
+}
+
+bool sqconn::fill() {
+    if (m_eof) return false;
+    char* buf = &m_buf[0];
+    // move decoded and raw data to the beginning of buffer
+    if ((m_pos > 0) || (m_raw > m_avail)) {
+       size_t decoded = m_avail - m_pos;
+       memmove(buf, buf + m_pos, decoded);
+       memmove(buf + decoded, buf + m_raw, m_end - m_raw);
+       m_end = decoded + (m_end - m_raw);
+       m_pos = 0;
+       m_avail = m_raw = decoded;
+    }
+    // whole buffer is occupied by one line
+    if (m_end == m_buf.size()) {
+       m_buf.resize(m_buf.size() * 2);
+       buf = &m_buf[0];
+    }
+    long long started = Utils::MonotonicUs();
+    ssize_t data;
+    while (true) {
+       data = read(m_sock, buf + m_end, m_buf.size() - m_end);
+       m_reads++;
+       if (data != -1) break;
+       if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+          wait(POLLIN, false);
+       } else if (errno != EINTR) {
+          throw sqconnException(strerror(errno));
+       }
+    }
+    m_io_us += Utils::MonotonicUs() - started;
+    if (data == 0) {
+       m_eof = true;
+       return false;
+    }
+    m_end += data;
+    m_bytes += data;
+    return true;
+}
+
+bool sqconn::decode() {
+    char* buf = &m_buf[0];
+    bool progress = false;
+    while ((!m_body_done) && (m_raw < m_end)) {
+       size_t n = m_end - m_raw;
+       if ((m_body_mode != BODY_CHUNKED) || (m_body_left > 0)) {
+          // plain body data, move it next to already decoded data
+          if ((m_body_mode != BODY_EOF) && (n > m_body_left))
+             n = m_body_left;
+          if (m_avail != m_raw)
+             memmove(buf + m_avail, buf + m_raw, n);
+          m_avail += n;
+          m_raw += n;
+          if (m_body_mode != BODY_EOF) {
+             m_body_left -= n;
+             if ((m_body_mode == BODY_LENGTH) && (m_body_left == 0))
+                m_body_done = true;
+          }
+          progress = true;
+          continue;
+       }
+       // chunked body at chunk boundary: chunk size line, CRLF after chunk data or trailer
+       char* nl = static_cast<char*>(memchr(buf + m_raw, '\n', n));
+       if (nl == NULL) break;
+       string line(buf + m_raw, nl);
+       m_raw = nl - buf + 1;
+       progress = true;
+       if (!line.empty() && (line[line.size()-1] == '\r'))
+          line.resize(line.size()-1);
+       if (m_chunk_crlf) {
+          m_chunk_crlf = false;
+          if (!line.empty()) throw sqconnException("Malformed chunked reply");
+       } else if (m_chunk_trailers) {
+          if (line.empty()) m_body_done = true;
+       } else {
+          char* end;
+          errno = 0;
+          unsigned long long size = strtoull(line.c_str(), &end, 16);
+          if ((end == line.c_str()) || (errno != 0))
+             throw sqconnException("Malformed chunked reply");
+          if (size == 0) {
+             m_chunk_trailers = true;
+          } else {
+             m_body_left = size;
+             m_chunk_crlf = true;
+          }
+       }
+    }
+    return progress;
+}
+
+bool sqconn::nextline(char*& rLine, size_t& rLen) {
+    // bytes after m_pos already known to have no EOL
+    size_t scanned = 0;
+    char* nl = NULL;
+    while (true) {
+       if (m_avail > m_pos + scanned) {
+          const char* end = &m_buf[0] + m_avail;
+          const char* found = Scan::FindByte(&m_buf[0] + m_pos + scanned, end, '\n');
+          if (found != end) {
+             nl = const_cast<char*>(found);
+             break;
+          }
+          scanned = m_avail - m_pos;
+       }
+       if (decode()) continue;
+       if (m_body_done) break;
+       if (!fill()) {
+          if (m_body_mode != BODY_EOF)
+             throw sqconnException("Connection closed before end of reply");
+          m_body_done = true;
+          break;
+       }
+    }
+    // end of body, hand out last unterminated line if any
+    if ((nl == NULL) && (m_pos == m_avail)) return false;
+
+    char* buf = &m_buf[0];
+    size_t eol = (nl != NULL) ? nl - buf : m_avail;
+    rLine = buf + m_pos;
+    rLen = eol - m_pos;
+    m_pos = (nl != NULL) ? eol + 1 : eol;
+    return true;
+}
+
+bool sqconn::getline(const char*& rLine, size_t& rLen) {
+    char* line;
+    size_t len;
+    if (!nextline(line, len)) return false;
+    // strip EOL, tabs and other control chars in place
+    char* start = Scan::SkipControl(line, line + len);
+    rLine = start;
+    rLen = Scan::StripControl(start, len - (start - line));
+    return true;
+}
+
+void sqconn::read_body(sqconnSink& rSink) {
+    const char* line;
+    size_t len;
+    while (getline(line, len)) {
+       rSink.Line(line, len);
+    }
+}
+
+string sqconn::read_headers() {
+    reset();
+
+    const char* line;
+    size_t len;
+    if (!getline(line, len)) return "";
+    string status(line, len);
+
+    while (getline(line, len)) {
+       // empty line ends headers
+       if (len == 0) break;
+       const char* colon = static_cast<const char*>(memchr(line, ':', len));
+       if (colon == NULL) continue;
+       string name(line, colon);
+       Utils::ToLower(name);
+       string value(colon + 1, line + len);
+       value.erase(0, value.find_first_not_of(" "));
+       m_headers[name] = value;
+    }
+
+    string connection = header("connection");
+    Utils::ToLower(connection);
+    if (status.compare(0, 8, "HTTP/1.1") == 0)
+       m_keepalive = (connection != "close");
+    else
+       m_keepalive = (connection == "keep-alive");
+
+    string encoding = header("transfer-encoding");
+    Utils::ToLower(encoding);
+    string length = header("content-length");
+    if (encoding.find("chunked") != string::npos) {
+       m_body_mode = BODY_CHUNKED;
+    } else if (!length.empty()) {
+       m_body_mode = BODY_LENGTH;
+       m_body_left = strtoull(length.c_str(), NULL, 10);
+    } else {
+       // reply ends with connection close
+       m_body_mode = BODY_EOF;
+       m_keepalive = false;
+    }
+    m_body_done = ((m_body_mode == BODY_LENGTH) && (m_body_left == 0));
+    // everything after headers is not decoded yet
+    m_avail = m_raw = m_pos;
+    return status;
+}
+
+string sqconn::header(const string& name) const {
+    std::map<string, string>::const_iterator it = m_headers.find(name);
+    if (it == m_headers.end()) return "";
+    return it->second;
 }
 
 }
@@ -7,11 +7,22 @@
 #define __SQCONN_H
 
 #include <string>
-//sockaddr_in
-#include <netinet/in.h>
+#include <vector>
+#include <map>
+//sockaddr_storage
+#include <sys/socket.h>
+//pollfd
+#include <poll.h>
 //exception
 #include <typeinfo>
 
+// initial size of receive buffer, grows if single line does not fit in it
+#define SQCONN_BUFSIZE 65536
+// seconds to keep resolved squid addresses
+#define SQCONN_ADDR_TTL 300
+// ms to wait for connect before trying next address in parallel
+#define SQCONN_FALLBACK_DELAY 250
+
 namespace sqtop {
 
 class sqconnException: public std::exception {
@@ -25,18 +36,127 @@ class sqconnException: public std::exception {
        std::string userMessage;
 };
 
+// connect or fetch deadline expired
+class sqconnTimeout: public sqconnException {
+    public:
+       sqconnTimeout(const std::string &message) throw() : sqconnException(message) {}
+};
+
+// I/O was aborted by sqconn::cancel()
+class sqconnCancelled: public sqconnException {
+    public:
+       sqconnCancelled() throw() : sqconnException("Cancelled") {}
+};
+
+// receiver of reply body lines, see sqconn::read_body
+class sqconnSink {
+    public:
+       virtual ~sqconnSink() {}
+       // line is valid only during the call
+       virtual void Line(const char* line, size_t len) = 0;
+};
+
 class sqconn {
     public:
        sqconn();
        ~sqconn();
 
        void open(std::string, int);
+       void close();
+       // deadlines in ms (0 - no deadline) for connect and for the whole fetch,
+       // fetch deadline is counted from this call
+       void set_deadlines(long connect_ms, long fetch_ms);
+       // aborts pending and all further I/O (may be called from other thread),
+       // blocked and next I/O calls throw sqconnCancelled
+       void cancel();
+       bool is_open() const { return m_sock > 0; }
+       const std::string& host() const { return m_host; }
+       int port() const { return m_port; }
+
        int operator << (const std::string);
        int operator >> (std::string&);
 
+       // reads status line and headers of reply and prepares body decoding
+       // (by Content-Length, chunked or until EOF). Returns status line,
+       // empty string if peer closed connection before sending anything.
+       std::string read_headers();
+       // value of reply header (name in lower case), empty if not present
+       std::string header(const std::string& name) const;
+       // peer agreed to keep connection open after current reply
+       bool keepalive() const { return m_keepalive; }
+
+       // hands out next line of reply body straight from receive buffer
+       // (without EOL and control chars), line is valid until next call.
+       // Returns false at the end of body.
+       bool getline(const char*& rLine, size_t& rLen);
+       // pushes every line of reply body to rSink as soon as it is received,
+       // so the body is processed while it is still arriving
+       void read_body(sqconnSink& rSink);
+
+       // read() syscalls made and bytes received for current reply
+       unsigned long read_calls() const { return m_reads; }
+       unsigned long long read_bytes() const { return m_bytes; }
+       // microseconds spent in read() and waiting for data for current reply
+       long long io_time() const { return m_io_us; }
+       // address lookups made since construction
+       unsigned long lookups() const { return m_lookups; }
+
     private:
        int m_sock;
-       struct sockaddr_in m_addr;
+
+       // resolved addresses of squid, cached for SQCONN_ADDR_TTL
+       struct sqaddr {
+          struct sockaddr_storage ss;
+          socklen_t len;
+       };
+       std::vector<sqaddr> m_addrs;
+       std::string m_addrs_host;
+       int m_addrs_port;
+       long long m_addrs_expire;
+       unsigned long m_lookups;
+       void resolve(const std::string& server, int port);
+
+       long m_connect_timeout;
+       long m_fetch_timeout;
+       long long m_connect_deadline;
+       long long m_fetch_deadline;
+       // self-pipe to wake up poll() on cancel
+       int m_cancel_pipe[2];
+       volatile int m_cancelled;
+       // waits for events on socket within deadlines
+       void wait(short events, bool connecting);
+       void poll_wait(std::vector<struct pollfd>& fds, bool connecting, long long wake_at);
+       std::string m_host;
+       int m_port;
+
+       enum BodyMode { BODY_EOF, BODY_LENGTH, BODY_CHUNKED };
+       BodyMode m_body_mode;
+       bool m_body_done;
+       // BODY_LENGTH: body bytes left, BODY_CHUNKED: bytes left in current chunk
+       unsigned long long m_body_left;
+       // BODY_CHUNKED: CRLF after chunk data is pending
+       bool m_chunk_crlf;
+       // BODY_CHUNKED: last chunk seen, skipping trailers
+       bool m_chunk_trailers;
+       bool m_keepalive;
+       std::map<std::string, std::string> m_headers;
+
+       std::vector<char> m_buf;
+       // decoded body data ready for getline is [m_pos, m_avail),
+       // raw data not decoded yet is [m_raw, m_end)
+       size_t m_pos;
+       size_t m_avail;
+       size_t m_raw;
+       size_t m_end;
+       bool m_eof;
+       bool fill();
+       bool decode();
+       bool nextline(char*& rLine, size_t& rLen);
+       void reset();
+
+       unsigned long m_reads;
+       unsigned long long m_bytes;
+       long long m_io_us;
 };
 
 }
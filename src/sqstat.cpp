@@ -30,62 +30,229 @@ using std::set;
 using std::cout;
 using std::endl;
 
-/* static */ bool sqstat::CompareURLs(UriStats a, UriStats b) {
-     return a.size > b.size;
+/* static */ bool sqstat::CompareURLs(const UriStats& a, const UriStats& b) {
+   // urls of the same size alphabetically, so order does not depend on sort algorithm
+   if (a.size != b.size) return a.size > b.size;
+   return a.uri < b.uri;
 }
 
-/* static */ bool sqstat::CompareIP(SquidConnection a, SquidConnection b) {
-   unsigned long ip1, ip2;
-   struct sockaddr_in n;
-   inet_aton(a.peer.c_str(), &n.sin_addr);
-   ip1 = ntohl(n.sin_addr.s_addr);
-   inet_aton(b.peer.c_str(), &n.sin_addr);
-   ip2 = ntohl(n.sin_addr.s_addr);
-   return ip1 < ip2;
+/* static */ bool sqstat::CompareIP(const SquidConnection& a, const SquidConnection& b) {
+   return a.addr < b.addr;
 }
 
-/* static */ bool sqstat::CompareSIZE(SquidConnection a, SquidConnection b) {
-     return a.sum_size > b.sum_size;
+void StatColumns::Clear() {
+   id.clear();
+   uri.clear();
+   username.clear();
+   size.clear();
+   etime_ms.clear();
+   etime.clear();
+   av_speed.clear();
+   curr_speed.clear();
+   delay_pool.clear();
+   peer.clear();
+   conn.clear();
 }
 
-/* static */ bool sqstat::CompareTIME(SquidConnection a, SquidConnection b) {
-   return a.max_etime > b.max_etime;
+void StatColumns::Swap(StatColumns& other) {
+   id.swap(other.id);
+   uri.swap(other.uri);
+   username.swap(other.username);
+   size.swap(other.size);
+   etime_ms.swap(other.etime_ms);
+   etime.swap(other.etime);
+   av_speed.swap(other.av_speed);
+   curr_speed.swap(other.curr_speed);
+   delay_pool.swap(other.delay_pool);
+   peer.swap(other.peer);
+   conn.swap(other.conn);
 }
 
-/* static */ bool sqstat::CompareAVSPEED(SquidConnection a, SquidConnection b) {
-   return a.av_speed > b.av_speed;
+void StatColumns::Append(const UriStats& stats, uint32_t index) {
+   id.push_back(stats.id);
+   uri.push_back(stats.uri);
+   username.push_back(stats.username);
+   size.push_back(stats.size);
+   etime_ms.push_back(stats.etime_ms);
+   etime.push_back(stats.etime);
+   av_speed.push_back(stats.av_speed);
+   curr_speed.push_back(stats.curr_speed);
+   delay_pool.push_back(stats.delay_pool);
+   peer.push_back(stats.peer);
+   conn.push_back(index);
 }
 
-/* static */ bool sqstat::CompareCURRSPEED(SquidConnection a, SquidConnection b) {
-   return a.curr_speed > b.curr_speed;
+template <typename T>
+static void ScatterColumn(const vector<T>& from, const vector<uint32_t>& place, vector<T>& to) {
+   to.resize(from.size());
+   for (size_t row = 0; row < from.size(); ++row)
+      to[place[row]] = from[row];
 }
 
-/* static */ void sqstat::CompactSameUrls(vector<SquidConnection>& sqconns) {
-   for (vector<SquidConnection>::iterator it = sqconns.begin(); it != sqconns.end(); ++it) {
-      std::map<string, UriStats> urls;
+template <typename T>
+static void GatherColumn(const vector<T>& from, const vector<uint32_t>& source, vector<T>& to) {
+   to.resize(source.size());
+   for (size_t row = 0; row < source.size(); ++row)
+      to[row] = from[source[row]];
+}
 
-      for (vector<UriStats>::iterator itu = it->stats.begin(); itu != it->stats.end(); ++itu) {
-         string url = itu->uri;
-         // TODO: check if username is the same ?
-         if (urls.find(url) == urls.end()) {
-            urls[url] = *itu;
-         }
-         else {
-            urls[url].count += 1;
-            urls[url].size += itu->size;
-            urls[url].etime += itu->etime;
-            // TODO: check this
-            if ((urls[url].size !=0) && (urls[url].etime != 0))
-               urls[url].av_speed = urls[url].size/urls[url].etime;
-         }
+void StatColumns::Scatter(const StatColumns& other, const vector<uint32_t>& place) {
+   ScatterColumn(other.id, place, id);
+   ScatterColumn(other.uri, place, uri);
+   ScatterColumn(other.username, place, username);
+   ScatterColumn(other.size, place, size);
+   ScatterColumn(other.etime_ms, place, etime_ms);
+   ScatterColumn(other.etime, place, etime);
+   ScatterColumn(other.av_speed, place, av_speed);
+   ScatterColumn(other.curr_speed, place, curr_speed);
+   ScatterColumn(other.delay_pool, place, delay_pool);
+   ScatterColumn(other.peer, place, peer);
+   ScatterColumn(other.conn, place, conn);
+}
+
+UriStats StatColumns::Row(size_t row) const {
+   UriStats stats(id[row]);
+   stats.count = 1;
+   stats.uri = uri[row];
+   stats.username = username[row];
+   stats.size = size[row];
+   stats.etime_ms = etime_ms[row];
+   stats.etime = etime[row];
+   stats.av_speed = av_speed[row];
+   stats.curr_speed = curr_speed[row];
+   stats.delay_pool = delay_pool[row];
+   stats.peer = peer[row];
+   return stats;
+}
+
+void StatColumns::Fill(SquidConnection& scon) const {
+   scon.stats.clear();
+   scon.stats.reserve(scon.stats_count);
+   for (size_t row = scon.first_stat; row < scon.first_stat + scon.stats_count; ++row)
+      scon.stats.push_back(Row(row));
+}
+
+/* static */ long sqstat::GroupStats(vector<SquidConnection>& connections, StatColumns& stats, StatColumns& grouped) {
+   size_t rows = stats.Size();
+   vector<size_t> next(connections.size());
+   for (size_t row = 0; row < rows; ++row)
+      next[stats.conn[row]]++;
+
+   // connections are ordered through their keys, moving each of them only once
+   vector<std::pair<Utils::IPAddr, uint32_t> > order(connections.size());
+   for (size_t index = 0; index < connections.size(); ++index)
+      order[index] = std::make_pair(connections[index].addr, static_cast<uint32_t>(index));
+   sort(order.begin(), order.end());
+   vector<SquidConnection> sorted(connections.size());
+   // rows of each connection are put together, in its new place
+   size_t first_stat = 0;
+   for (size_t index = 0; index < order.size(); ++index) {
+      uint32_t old = order[index].second;
+      std::swap(sorted[index], connections[old]);
+      sorted[index].first_stat = first_stat;
+      sorted[index].stats_count = next[old];
+      first_stat += next[old];
+      // next row of old connection goes there
+      next[old] = sorted[index].first_stat;
+   }
+   connections.swap(sorted);
+   // row of stats each grouped row comes from
+   vector<uint32_t> source(rows);
+   for (size_t row = 0; row < rows; ++row)
+      source[next[stats.conn[row]]++] = row;
+   // other columns are filled below; if squid listed requests grouped by client already, it is plain copy
+   GatherColumn(stats.id, source, grouped.id);
+   GatherColumn(stats.uri, source, grouped.uri);
+   GatherColumn(stats.username, source, grouped.username);
+   GatherColumn(stats.curr_speed, source, grouped.curr_speed);
+   GatherColumn(stats.delay_pool, source, grouped.delay_pool);
+   grouped.size.resize(rows);
+   grouped.etime_ms.resize(rows);
+   grouped.etime.resize(rows);
+   grouped.av_speed.resize(rows);
+   grouped.peer.resize(rows);
+   grouped.conn.resize(rows);
+
+   // speeds and sums over contiguous rows of each connection (peer of request is peer of its connection)
+   long av_speed = 0;
+   for (size_t index = 0; index < connections.size(); ++index) {
+      SquidConnection& conn = connections[index];
+      size_t end = conn.first_stat + conn.stats_count;
+      for (size_t row = conn.first_stat; row < end; ++row) {
+         long long size = stats.size[source[row]];
+         long long etime_ms = stats.etime_ms[source[row]];
+         grouped.size[row] = size;
+         grouped.etime_ms[row] = etime_ms;
+         grouped.etime[row] = etime_ms / 1000;
+         grouped.av_speed[row] = ((size != 0) && (etime_ms != 0)) ? size*1000/etime_ms : 0;
+         grouped.peer[row] = conn.peer;
+         grouped.conn[row] = index;
+         conn.sum_size += size;
+         conn.av_speed += grouped.av_speed[row];
+         conn.max_etime = std::max(conn.max_etime, grouped.etime[row]);
       }
+      av_speed += conn.av_speed;
+   }
+   return av_speed;
+}
 
-      it->stats.clear();
-      for (std::map<string, UriStats>::iterator itm=urls.begin(); itm!=urls.end(); itm++) {
-         it->stats.push_back(itm->second);
+void UrlCompactor::Compact(SquidConnection& scon, size_t top) {
+   vector<UriStats>& stats = scon.stats;
+   // first request to each url is moved to the front, following ones are merged into it
+   size_t out = 0;
+   for (size_t i = 0; i < stats.size(); ++i) {
+      bool inserted;
+      size_t* pFirst = index.Insert(&stats[i].uri.str(), &inserted);
+      if (inserted) {
+         *pFirst = out;
+         if (out != i) stats[out] = stats[i];
+         out++;
+         continue;
       }
-      sort(it->stats.begin(), it->stats.end(), CompareURLs);
+      // TODO: check if username is the same ?
+      UriStats& first = stats[*pFirst];
+      first.count += 1;
+      first.size += stats[i].size;
+      first.etime += stats[i].etime;
+      first.etime_ms += stats[i].etime_ms;
+      // TODO: check this
+      if ((first.size != 0) && (first.etime_ms != 0))
+         first.av_speed = first.size*1000/first.etime_ms;
    }
+   stats.resize(out);
+   // only inserted keys are removed, clearing whole table would cost its capacity
+   for (size_t i = 0; i < out; ++i)
+      index.Erase(&stats[i].uri.str());
+
+   if (top < stats.size())
+      std::partial_sort(stats.begin(), stats.begin() + top, stats.end(), sqstat::CompareURLs);
+   else
+      sort(stats.begin(), stats.end(), sqstat::CompareURLs);
+}
+
+/* static */ void sqstat::CompactSameUrls(vector<SquidConnection>& sqconns, size_t top) {
+   UrlCompactor compactor;
+   for (vector<SquidConnection>::iterator it = sqconns.begin(); it != sqconns.end(); ++it)
+      compactor.Compact(*it, top);
+}
+
+/* static */ vector<Atom> sqstat::FilterUsers(const SquidStats& stats, const vector<string>& users) {
+   vector<Atom> result;
+   if (stats.strings.get() == NULL) return result;
+   for (vector<string>::const_iterator it = users.begin(); it != users.end(); ++it) {
+      result.push_back(stats.strings->Find(*it));
+   }
+   return result;
+}
+
+/* static */ bool sqstat::HostMemberOf(const SubnetTrie& hosts, const SquidConnection& scon) {
+   if (scon.peers.empty())
+      return hosts.Covers(scon.addr);
+   // group matches if any of its clients does
+   for (vector<Utils::IPAddr>::const_iterator it = scon.peers.begin(); it != scon.peers.end(); ++it) {
+      if (hosts.Covers(*it)) return true;
+   }
+   return false;
 }
 
 /* static */ string sqstat::HeadFormat(Options* pOpts, int active_conn, int active_ips, long av_speed) {
@@ -102,51 +269,74 @@ using std::endl;
 
 /* static */ string sqstat::ConnFormat(Options* pOpts, SquidConnection& scon) {
    std::stringstream result;
+   string condetail="";
 
-   result << "  Host: ";
-#ifdef WITH_RESOLVER
-   string resolved;
-   if (pOpts->dns_resolution) {
-      string tmp = scon.hostname;
-      if (pOpts->strip_host_domain) {
-         Resolver::StripDomain(tmp);
-      }
-      switch (pOpts->resolve_mode) {
-         case Options::SHOW_NAME:
-            resolved = tmp;
+   if (!scon.peers.empty()) {
+      // group of requests in user, delay pool, subnet or domain view
+      switch (pOpts->group_by) {
+         case Options::GROUP_DELAY_POOL:
+            result << "  Delay pool: ";
             break;
-         case Options::SHOW_IP:
-            resolved = scon.peer;
+         case Options::GROUP_SUBNET:
+            result << "  Subnet: ";
             break;
-         case Options::SHOW_BOTH:
-            if (!tmp.compare(scon.peer)) {
-               resolved = scon.peer;
-            } else {
-               resolved = tmp + " [" + scon.peer + "]";
-            }
+         case Options::GROUP_DOMAIN:
+            result << "  Domain: ";
             break;
-      };
+         default:
+            result << "  User: ";
+            break;
+      }
+      result << scon.peer;
+      condetail += "hosts: " + Utils::itos(scon.peers.size()) + ", ";
+      if (pOpts->group_by != Options::GROUP_USER) {
+         set<string> users;
+         for (set<Atom>::iterator it = scon.usernames.begin(); it != scon.usernames.end(); ++it)
+            users.insert(pOpts->strip_user_domain ? Utils::StripUserDomain(*it) : it->str());
+         condetail += "users: " + Utils::itos(users.size()) + ", ";
+      }
+      condetail += "sessions: " + Utils::itos(pOpts->TreeView() ? scon.tree_count : scon.stats_count) + ", ";
    } else {
-      resolved = scon.peer;
-   }
-   result << resolved;
+      result << "  Host: ";
+#ifdef WITH_RESOLVER
+      string resolved;
+      if (pOpts->dns_resolution) {
+         string tmp = scon.hostname;
+         if (pOpts->strip_host_domain) {
+            Resolver::StripDomain(tmp);
+         }
+         switch (pOpts->resolve_mode) {
+            case Options::SHOW_NAME:
+               resolved = tmp;
+               break;
+            case Options::SHOW_IP:
+               resolved = scon.peer;
+               break;
+            case Options::SHOW_BOTH:
+               if (!tmp.compare(scon.peer)) {
+                  resolved = scon.peer;
+               } else {
+                  resolved = tmp + " [" + scon.peer.str() + "]";
+               }
+               break;
+         };
+      } else {
+         resolved = scon.peer;
+      }
+      result << resolved;
 #else
-   result << scon.peer;
+      result << scon.peer;
 #endif
-   if (!scon.usernames.empty()) {
-      set<string> users;
-      if (pOpts->strip_user_domain) {
-         for (set<string>::iterator it = scon.usernames.begin(); it != scon.usernames.end(); ++it) {
-            users.insert(Utils::StripUserDomain(*it));
+      if (!scon.usernames.empty()) {
+         set<string> users;
+         for (set<Atom>::iterator it = scon.usernames.begin(); it != scon.usernames.end(); ++it) {
+            users.insert(pOpts->strip_user_domain ? Utils::StripUserDomain(*it) : it->str());
          }
-      } else {
-         users = scon.usernames;
+         result << "; " << (users.size() == 1 ? "User: " : "Users: ") << Utils::UsernamesToStr(users);
       }
-      result << "; " << (users.size() == 1 ? "User: " : "Users: ") << Utils::UsernamesToStr(users);
    }
 
-   string condetail="";
-   if (pOpts->full || pOpts->brief)
+   if ((pOpts->full || pOpts->brief) && scon.peers.empty())
       condetail += "sessions: " + Utils::itos(scon.stats.size()) + ", ";
    if (pOpts->zero || (scon.sum_size > 1024))
       condetail += "size: " + Utils::ConvertSize(scon.sum_size) + ", ";
@@ -206,8 +396,10 @@ string sqstat::SpeedsFormat(Options::SPEED_MODE mode, long av_speed, long curr_s
          udetail += "size: " + Utils::ConvertSize(ustat.size) + ", ";
       if (pOpts->full && ((pOpts->zero || (ustat.etime > 0))))
          udetail += "time: " + Utils::ConvertTime(ustat.etime) + ", ";
+      if (scon.peers.size() > 1)
+         udetail += "host: " + ustat.peer.str() + ", ";
       if (scon.usernames.size() > 1)
-         udetail += "user: " + (pOpts->strip_user_domain ? Utils::StripUserDomain(ustat.username) : ustat.username ) + ", ";
+         udetail += "user: " + (pOpts->strip_user_domain ? Utils::StripUserDomain(ustat.username) : ustat.username.str() ) + ", ";
       if (pOpts->zero || (ustat.av_speed > 103) || (ustat.curr_speed > 103))
          udetail += SpeedsFormat(pOpts->speed_mode, ustat.av_speed, ustat.curr_speed) + ", ";
       if (pOpts->full && (pOpts->zero || (ustat.delay_pool != 0)))
@@ -220,20 +412,20 @@ string sqstat::SpeedsFormat(Options::SPEED_MODE mode, long av_speed, long curr_s
    return result.str();
 }
 
-void sqstat::FormatChanged(string line) {
+void sqstat::FormatChanged(Utils::StrRef line) {
    std::stringstream result;
    result << "Warning!!! Please send bug report.";
-   result << " active_requests format changed - \'" << line << "\'.";
+   result << " active_requests format changed - \'" << line.str() << "\'.";
    result << " " << squid_version << ".";
    result << " " << PACKAGE_NAME << "-" << VERSION;
    throw sqstatException(result.str(), FORMAT_CHANGED);
 }
 
 #ifdef WITH_RESOLVER
-string sqstat::DoResolve(string peer) {
+string sqstat::DoResolve(string peer, long long bytes) {
    string resolved;
    if (pOpts->dns_resolution) {
-      resolved = pResolver->Resolve(peer);
+      resolved = pResolver->Resolve(peer, bytes);
    } else {
       resolved = peer;
    }
@@ -241,165 +433,391 @@ string sqstat::DoResolve(string peer) {
 }
 #endif
 
-SquidStats sqstat::GetInfo() {
-   sqconn con;
-
-   string line;
-
-   sqstats.total_connections = 0;
+void sqstat::Cancel() {
+   con.cancel();
+}
 
-   map <string, SquidConnection>::iterator Conn_it; // pointer to current peer
-   vector<UriStats>::iterator Stat_it; // pointer to current stat
-   UriStats newStats;
+// closes connection and rethrows sqconn error as sqstatException
+void sqstat::ConnFailed(const sqconnException& e, int code, string context) {
+   con.close();
+   if (dynamic_cast<const sqconnTimeout*>(&e) != NULL) {
+      code = FETCH_TIMEOUT;
+   } else if (dynamic_cast<const sqconnCancelled*>(&e) != NULL) {
+      code = CANCELLED;
+   }
+   throw sqstatException(e.what() + context, code);
+}
 
+void sqstat::Connect() {
    try {
       con.open(pOpts->host, pOpts->port);
    } catch(sqconnException &e) {
-      std::stringstream error;
-      error << e.what() << " while connecting to " << pOpts->host << ":" << pOpts->port;
-      throw sqstatException(error.str(), FAILED_TO_CONNECT);
+      std::stringstream context;
+      context << " while connecting to " << pOpts->host << ":" << pOpts->port;
+      ConnFailed(e, FAILED_TO_CONNECT, context.str());
    }
+}
 
-   connections.clear();
-
-   // TODO: use milliseconds from <chrono>
-   time_t time_before_get = 0, time_before_process = 0;
+string sqstat::Request() {
+   string request;
+   if (pOpts->keepalive) {
+      request = "GET cache_object://localhost/active_requests HTTP/1.1\n";
+      request += "Host: localhost\n";
+      request += "Connection: keep-alive\n";
+   } else {
+      request = "GET cache_object://localhost/active_requests HTTP/1.0\n";
+   }
+   if (!pOpts->pass.empty()) {
+      // encode credentials only when password changes
+      if (pOpts->pass != auth_pass) {
+         auth_pass = pOpts->pass;
+         auth_header = "Authorization: Basic " + Base64::Encode("admin:" + auth_pass) + "\n";
+      }
+      request += auth_header;
+   }
+   return request;
+}
 
-   vector<string> active_requests;
+void sqstat::CommitStats() {
+   if (!newStatsOpen) return;
+   newStatsOpen = false;
+   if (newPeer.empty()) return;
+
+   bool inserted;
+   size_t* pIndex = peers.Insert(newPeerAddr, &inserted);
+   // if it is new peer, create new SquidConnection
+   if (inserted) {
+      *pIndex = connections.size();
+      SquidConnection connection;
+      connection.peer = newPeer;
+      connection.addr = newPeerAddr;
+      connections.push_back(connection);
+   }
+   SquidConnection& conn = connections[*pIndex];
+
+   OldStat* pOld = oldstats.Insert(newStatsKey);
+   OldPeer* pPeer = oldpeers.Insert(newPeerAddr);
+   // bytes request transferred since previous stats of its peer
+   if (!pOld->rate.Empty() && (newStats.size >= pOld->rate.LastBytes())) {
+      pPeer->bytes += newStats.size - pOld->rate.LastBytes();
+   } else if (!pPeer->rate.Empty() && (newStats.etime_ms > 0)) {
+      // new request, only part of it made after previous stats counts
+      long long since_last = sqstats.stamp - pPeer->rate.LastStamp();
+      if (newStats.etime_ms <= since_last)
+         pPeer->bytes += newStats.size;
+      else if (since_last > 0)
+         pPeer->bytes += newStats.size * since_last / newStats.etime_ms;
+   }
+   pPeer->generation = generation;
+   pOld->rate.Add(sqstats.stamp, newStats.size);
+   pOld->generation = generation;
+   newStats.curr_speed = pOld->rate.Rate(pOpts->rate_window);
+
+   if (!newStats.username.empty())
+      conn.usernames.insert(newStats.username);
+   newStats.peer = conn.peer;
+   stats.Append(newStats, *pIndex);
+}
 
-   try {
-      string request = "GET cache_object://localhost/active_requests HTTP/1.0\n";
-      if (!pOpts->pass.empty()) {
-         string encoded = Base64::Encode("admin:" + pOpts->pass);
-         request += "Authorization: Basic " + encoded + "\n";
+// binary address of peer, peers that are not IP addresses get a key out of IPv6 range
+static Utils::IPAddr PeerKey(Utils::StrRef peer) {
+   Utils::IPAddr addr;
+   if (!Utils::ParseIP(peer, addr)) {
+      // FNV-1a
+      uint64_t hash = 14695981039346656037ULL;
+      for (size_t i = 0; i < peer.len; ++i) {
+         hash ^= static_cast<unsigned char>(peer.data[i]);
+         hash *= 1099511628211ULL;
       }
-      time_before_get = time(NULL);
-      con << request;
-      while ((con >> line) != 0) {
-         active_requests.push_back(line);
+      addr = Utils::IPAddr(~0ULL, hash);
+   }
+   return addr;
+}
+
+// request id is address of squid's connection structure, like 0x55d0c8a3e2f8
+static uint64_t RequestKey(Utils::StrRef id) {
+   uint64_t key = 0;
+   bool hex = (id.len > 2) && (id.len <= 18) && (id.data[0] == '0') && (id.data[1] == 'x');
+   for (size_t i = 2; hex && (i < id.len); ++i) {
+      char c = id.data[i];
+      if ((c >= '0') && (c <= '9')) key = (key << 4) | (c - '0');
+      else if ((c >= 'a') && (c <= 'f')) key = (key << 4) | (c - 'a' + 10);
+      else if ((c >= 'A') && (c <= 'F')) key = (key << 4) | (c - 'A' + 10);
+      else hex = false;
+   }
+   if (!hex) {
+      // not an address - use FNV-1a of id
+      key = 14695981039346656037ULL;
+      for (size_t i = 0; i < id.len; ++i) {
+         key ^= static_cast<unsigned char>(id.data[i]);
+         key *= 1099511628211ULL;
       }
-      sqstats.get_time = time(NULL) - time_before_get;
-   } catch(sqconnException &e) {
-      throw sqstatException(e.what(), UNKNOWN_ERROR);
    }
+   return key;
+}
 
-   time_before_process = time(NULL);
-   if (active_requests.size() < 1) {
-      throw sqstatException("Empty reply from squid", UNKNOWN_ERROR);
-   } else if (active_requests[0] != "HTTP/1.0 200 OK" &&
-              active_requests[0] != "HTTP/1.1 200 OK") {
-      throw sqstatException("Access to squid statistic denied: "+ active_requests[0], ACCESS_DENIED);
+// removes entries not seen by GetInfo call number generation, returns how many
+template <typename Table>
+static unsigned long ExpireGeneration(Table& table, unsigned long generation) {
+   unsigned long evicted = 0;
+   for (size_t slot = 0; slot < table.Capacity(); ) {
+      if (table.Used(slot) && (table.ValueAt(slot).generation != generation)) {
+         // other entry may be moved into this slot, so check it again
+         table.EraseSlot(slot);
+         evicted++;
+      } else {
+         ++slot;
+      }
    }
+   table.Compact();
+   return evicted;
+}
 
-   for (vector<string>::iterator it = active_requests.begin()+1; it != active_requests.end(); ++it) {
-      line = *it;
+void sqstat::ExpireOldStats() {
+   unsigned long evicted = ExpireGeneration(oldstats, generation);
+   ExpireGeneration(oldpeers, generation);
+   sqstats.oldstats_size = oldstats.Size();
+   sqstats.oldstats_evicted = evicted;
+   sqstats.oldstats_evicted_total += evicted;
+}
 
-      vector<string> result;
-      if (line.substr(0,8) == "Server: ") {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 2) {
-            squid_version = result[1];
-         } else { FormatChanged(line); }
-      } else if (line.substr(0,12) == "Connection: ") {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 2) {
-            newStats = UriStats(result[1]);
-         } else { FormatChanged(line); }
-      } else if ((line.substr(0,6) == "peer: ") or (line.substr(0,8) == "remote: ")) {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 2) {
-            std::pair <string, string> peer = Utils::SplitIPPort(result[1]);
-            if (!peer.first.empty()) {
-               Conn_it = connections.find(peer.first);
-               // if it is new peer, create new SquidConnection
-               if (Conn_it == connections.end()) {
-                  SquidConnection connection;
-                  connection.peer = peer.first;
-#ifdef WITH_RESOLVER
-                  connection.hostname = DoResolve(peer.first);
-#endif
-                  Conn_it = connections.insert( std::pair<string, SquidConnection>(peer.first, connection) ).first;
+#define STARTS_WITH(ref, prefix) (ref).StartsWith(prefix, sizeof(prefix) - 1)
+
+void sqstat::Line(const char* pline, size_t len) {
+   using Utils::StrRef;
+
+   StrRef line(pline, len);
+   sqstats.parse_lines++;
+   sqstats.parse_bytes += len;
+   if (len == 0) return;
+
+   // enough for any line we are interested in, see checks below
+   StrRef result[5];
+   size_t parts = 0;
+   // dispatch on first char, so each line is compared with one or two prefixes only
+   switch (line.data[0]) {
+      case 'C':
+         if (STARTS_WITH(line, "Connection: ")) {
+            parts = Utils::SplitRef(line, ' ', result, 5);
+            if (parts == 2) {
+               // previous request is complete
+               CommitStats();
+               newStats = UriStats(sqstats.strings->Intern(result[1].data, result[1].len));
+               newStatsKey = RequestKey(result[1]);
+               newPeer = Atom();
+               newStatsOpen = true;
+            } else { FormatChanged(line); }
+         }
+         return;
+      case 'p':
+         if (!STARTS_WITH(line, "peer: ")) return;
+         break;
+      case 'r':
+         if (!STARTS_WITH(line, "remote: ")) return;
+         break;
+      case 'u':
+         if (!STARTS_WITH(line, "uri ") && !STARTS_WITH(line, "username ")) return;
+         break;
+      case 'o':
+         if (!STARTS_WITH(line, "out.offset ")) return;
+         break;
+      case 's':
+         if (!STARTS_WITH(line, "start ")) return;
+         break;
+      case 'd':
+         if (!STARTS_WITH(line, "delay_pool ")) return;
+         break;
+      default:
+         return;
+   }
+   if (!newStatsOpen) return;
+
+   parts = Utils::SplitRef(line, ' ', result, 5);
+   switch (line.data[0]) {
+      case 'p':
+      case 'r':
+         // peer: ip:port or remote: ip:port
+         if (parts == 2) {
+            const char* colon = NULL;
+            for (const char* p = result[1].data + result[1].len; p != result[1].data; --p) {
+               if (*(p-1) == ':') {
+                  colon = p-1;
+                  break;
                }
-               Conn_it->second.stats.push_back(newStats);
-               Stat_it = Conn_it->second.stats.end() - 1;
+            }
+            if ((colon != NULL) && (colon != result[1].data)) {
+               StrRef peer(result[1].data, colon - result[1].data);
+               newPeerAddr = PeerKey(peer);
+               // peer text is interned only once, for new connection
+               size_t* pIndex = peers.Find(newPeerAddr);
+               newPeer = (pIndex != NULL) ? connections[*pIndex].peer : sqstats.strings->Intern(peer.data, peer.len);
             }
          } else { FormatChanged(line); }
-      } else if (line.substr(0,4) == "uri ") {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 2) {
-            Stat_it->uri = result[1];
-            Stat_it->count = 1;
-            Stat_it->curr_speed = 0;
-            Stat_it->av_speed = 0;
-         } else { FormatChanged(line); }
-      } else if (line.substr(0,11) == "out.offset ") {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 4) {
-            Stat_it->size = atoll(result[3].c_str());
-            Conn_it->second.sum_size += Stat_it->size;
-         } else { FormatChanged(line); }
-      } else if (line.substr(0,6) == "start ") {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 5) {
-            Stat_it->etime = atoi(result[2].erase(0,1).c_str());
-            if (Stat_it->etime > Conn_it->second.max_etime)
-               Conn_it->second.max_etime = Stat_it->etime;
-
-            map<string, OldStat>::iterator size_it = oldstats.find(Stat_it->id);
-            // store old progress in new connection stat
-            Stat_it->oldsize = size_it != oldstats.end() ? size_it->second.size : 0;
-            Stat_it->oldetime = size_it != oldstats.end() ? size_it->second.etime : 0;
-            // replace old progress with new
-            oldstats[Stat_it->id] = OldStat(Stat_it->size, Stat_it->etime);
-
-         } else { FormatChanged(line); }
-      } else if (line.substr(0,11) == "delay_pool ") {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 2) {
-            Stat_it->delay_pool = atoi(result[1].c_str());
+         break;
+      case 'u':
+         if (line.data[1] == 'r') {
+            // uri URL
+            if (parts == 2) {
+               newStats.uri = sqstats.strings->Intern(result[1].data, result[1].len);
+               newStats.count = 1;
+               newStats.curr_speed = 0;
+               newStats.av_speed = 0;
+            } else { FormatChanged(line); }
+         } else {
+            // username NAME
+            if (parts == 2) {
+               if (!(result[1] == "-") && (!result[1].empty())) {
+                  lowered.assign(result[1].data, result[1].len);
+                  Utils::ToLower(lowered);
+                  newStats.username = sqstats.strings->Intern(lowered);
+               }
+            } else if (parts != 1) { FormatChanged(line); }
+         }
+         break;
+      case 'o':
+         // out.offset N, out.size N
+         if (parts == 4) {
+            newStats.size = Utils::ToLL(result[3]);
          } else { FormatChanged(line); }
-      } else if (line.substr(0,9) == "username ") {
-         result = Utils::SplitString(line, " ");
-         if (result.size() == 1) {
-            continue;
-         } else if (result.size() == 2) {
-            if ((result[1] != "-") && (!result[1].empty())) {
-               Stat_it->username = result[1];
-               Utils::ToLower(Stat_it->username);
-               Conn_it->second.usernames.insert(Stat_it->username);
+         break;
+      case 's':
+         // start TIMESTAMP (N.NNN seconds ago)
+         if (parts == 5) {
+            StrRef etime = result[2];
+            if (!etime.empty()) {
+               etime.data++;
+               etime.len--;
             }
+            newStats.etime_ms = Utils::SecondsToMs(etime);
+            newStats.etime = newStats.etime_ms / 1000;
          } else { FormatChanged(line); }
-      }
+         break;
+      case 'd':
+         // delay_pool N
+         if (parts == 2) {
+            newStats.delay_pool = Utils::ToLL(result[1]);
+         } else { FormatChanged(line); }
+         break;
    }
+}
 
-   sqstats.av_speed = 0;
-   sqstats.curr_speed = 0;
-   sqstats.connections.clear();
-   for (map<string, SquidConnection>::iterator Conn = connections.begin(); Conn != connections.end(); ++Conn) {
-      sqstats.total_connections += Conn->second.stats.size();
-
-      for (vector<UriStats>::iterator Stats = Conn->second.stats.begin(); Stats != Conn->second.stats.end(); ++Stats) {
-         if ((Stats->size != 0) && (Stats->etime != 0)) {
-            Stats->av_speed = Stats->size/Stats->etime;
-            Conn->second.av_speed += Stats->av_speed;
-            sqstats.av_speed += Stats->av_speed;
-         }
-         if ((Stats->size != 0) && (Stats->oldsize != 0) &&
-             (Stats->etime != 0) && (Stats->oldetime != 0) &&
-             (Stats->size > Stats->oldsize) &&
-             (Stats->etime > Stats->oldetime)) {
-            long time_between_get = Stats->etime - Stats->oldetime;
-            if (time_between_get < 1) time_between_get = 1;
-            Stats->curr_speed = (Stats->size - Stats->oldsize) / time_between_get;
-            Conn->second.curr_speed += Stats->curr_speed;
-            sqstats.curr_speed += Stats->curr_speed;
+#undef STARTS_WITH
+
+SquidStats sqstat::GetInfo() {
+   SquidStats result;
+   Fetch(result);
+   return result;
+}
+
+SharedRef<SquidStats> sqstat::GetSnapshot() {
+   SquidStats* pStats = new SquidStats();
+   // owns stats even if Fetch throws
+   SharedRef<SquidStats> snapshot(pStats);
+   Fetch(*pStats);
+   return snapshot;
+}
+
+void sqstat::Fetch(SquidStats& result) {
+   sqstats.total_connections = 0;
+
+   connections.clear();
+   peers.Clear();
+   stats.Clear();
+   newStatsOpen = false;
+   generation++;
+   // strings of previous snapshot stay alive while someone uses it
+   sqstats.strings = StringPoolRef(new StringPool());
+
+   long long time_before_get = 0, time_before_process = 0;
+
+   string request = Request();
+   string status;
+   time_before_get = Utils::MonotonicMs();
+   con.set_deadlines(pOpts->connect_timeout, pOpts->fetch_timeout);
+   for (int attempt = 0; status.empty() && (attempt < 2); ++attempt) {
+      bool reused = pOpts->keepalive && con.is_open() &&
+                    (con.host() == pOpts->host) && (con.port() == pOpts->port);
+      if (!reused) Connect();
+      try {
+         con << request;
+         status = con.read_headers();
+      } catch(sqconnException &e) {
+         // only error on reused connection is worth retrying
+         if (!reused || (dynamic_cast<sqconnTimeout*>(&e) != NULL) ||
+                        (dynamic_cast<sqconnCancelled*>(&e) != NULL)) {
+            ConnFailed(e, UNKNOWN_ERROR);
          }
+         con.close();
       }
-      sqstats.connections.push_back(Conn->second);
+      // squid closed idle keep-alive connection - reconnect and try again
+      if (status.empty()) {
+         con.close();
+         if (!reused) break;
+      }
+   }
+
+   if (status.empty()) {
+      throw sqstatException("Empty reply from squid", UNKNOWN_ERROR);
+   } else if (status != "HTTP/1.0 200 OK" &&
+              status != "HTTP/1.1 200 OK") {
+      con.close();
+      throw sqstatException("Access to squid statistic denied: "+ status, ACCESS_DENIED);
    }
-   sqstats.process_time = time(NULL) - time_before_process;
 
-   return sqstats;
+   if (!con.header("server").empty())
+      squid_version = con.header("server");
+
+   try {
+      // connections are built while reply is still arriving
+      sqstats.parse_lines = 0;
+      sqstats.parse_bytes = 0;
+      long long time_before_body = Utils::MonotonicUs();
+      sqstats.stamp = time_before_body / 1000;
+      long long io_before_body = con.io_time();
+      con.read_body(*this);
+      CommitStats();
+      ExpireOldStats();
+      sqstats.parse_time = (Utils::MonotonicUs() - time_before_body) - (con.io_time() - io_before_body);
+      sqstats.get_time = Utils::MonotonicMs() - time_before_get;
+      sqstats.read_calls = con.read_calls();
+      sqstats.read_bytes = con.read_bytes();
+      sqstats.addr_lookups = con.lookups();
+   } catch(sqconnException &e) {
+      ConnFailed(e, UNKNOWN_ERROR);
+   } catch(sqstatException &e) {
+      // rest of reply is not read, connection can not be reused
+      con.close();
+      throw;
+   }
+   if (!pOpts->keepalive || !con.keepalive())
+      con.close();
+
+   time_before_process = Utils::MonotonicMs();
+
+   sqstats.total_connections = stats.Size();
+   sqstats.curr_speed = 0;
+   for (vector<SquidConnection>::iterator Conn = connections.begin(); Conn != connections.end(); ++Conn) {
+      OldPeer* pPeer = oldpeers.Find(Conn->addr);
+      pPeer->rate.Add(sqstats.stamp, pPeer->bytes);
+      Conn->curr_speed = pPeer->rate.Rate(pOpts->rate_window);
+      sqstats.curr_speed += Conn->curr_speed;
+   }
+   StatColumns grouped;
+   sqstats.av_speed = GroupStats(connections, stats, grouped);
+   sqstats.process_time = Utils::MonotonicMs() - time_before_process;
+#ifdef WITH_RESOLVER
+   // after sums, so resolver knows which hosts move more bytes
+   for (vector<SquidConnection>::iterator Conn = connections.begin(); Conn != connections.end(); ++Conn)
+      Conn->hostname = DoResolve(Conn->peer, Conn->sum_size);
+   if (pOpts->dns_resolution)
+      pResolver->Flush();
+#endif
+
+   // connections are moved, not copied to result
+   result = sqstats;
+   result.generation = generation;
+   result.connections.swap(connections);
+   result.stats.Swap(grouped);
 }
 
 }
@@ -16,28 +16,38 @@
 #include "config.h"
 
 #include "options.hpp"
+#include "sqconn.hpp"
+#include "Utils.hpp"
+#include "StringPool.hpp"
+#include "FlatHash.hpp"
+#include "Shared.hpp"
+#include "Rate.hpp"
 
 namespace sqtop {
 
+// strings in stats are atoms from SquidStats::strings pool
 struct UriStats {
-   std::string id;
+   Atom id;
    int count;
-   std::string uri;
-   long long oldsize; // to calculate current speed, while using ncui
+   Atom uri;
    long long size;
-   long oldetime; // to calculate current speed, while using ncui
    long etime;
+   long long etime_ms; // etime with fractional part, in milliseconds
    long av_speed;
-   long curr_speed;
+   long curr_speed; // over Options::rate_window
    int delay_pool;
-   std::string username;
-   // TODO: UriStats() : UriStats("") {};
-   UriStats() : id(""), count(0), uri(""), oldsize(0), size(0), oldetime(0), etime(0), delay_pool(-1), username("") {};
-   UriStats(std::string id) : id(id), count(0), uri(""), oldsize(0), size(0), oldetime(0), etime(0), delay_pool(-1), username("") {};
+   Atom username;
+   // client made the request
+   Atom peer;
+   // TODO: UriStats() : UriStats(Atom()) {};
+   UriStats() : count(0), size(0), etime(0), etime_ms(0), av_speed(0), curr_speed(0), delay_pool(-1) {};
+   UriStats(Atom id) : id(id), count(0), size(0), etime(0), etime_ms(0), av_speed(0), curr_speed(0), delay_pool(-1) {};
 };
 
 struct SquidConnection {
-   std::string peer;
+   Atom peer;
+   // binary peer address, connections are grouped and ordered by it
+   Utils::IPAddr addr;
 #ifdef WITH_RESOLVER
    std::string hostname;
 #endif
@@ -45,38 +55,138 @@ struct SquidConnection {
    long max_etime;
    long av_speed;
    long curr_speed;
+   // rows of requests in SquidStats::stats
+   size_t first_stat;
+   size_t stats_count;
+   // empty in snapshots, filled from rows by StatColumns::Fill
    std::vector<UriStats> stats;
-   std::set<std::string> usernames;
-   SquidConnection() : sum_size(0), max_etime(0), av_speed(0), curr_speed(0) {};
+   std::set<Atom> usernames;
+   // clients of group in user, delay pool, subnet and domain views (peer is then name of group) in
+   // address order, empty for hosts; vector, as rows with thousands of clients are copied on every refresh
+   std::vector<Utils::IPAddr> peers;
+   // nesting level in tree views (subnets of each level, then hosts; domains, then their subdomains), 0 in others
+   int depth;
+   // tree views: requests of row and all rows below it, stats_count are only its own ones
+   size_t tree_count;
+   SquidConnection() : sum_size(0), max_etime(0), av_speed(0), curr_speed(0), first_stat(0), stats_count(0), depth(0), tree_count(0) {};
+};
+
+// Requests of snapshot as columns, one row per request, strings are atoms of the snapshot pool.
+// Rows of each connection follow each other in order squid listed them.
+struct StatColumns {
+   std::vector<Atom> id;
+   std::vector<Atom> uri;
+   std::vector<Atom> username;
+   std::vector<long long> size;
+   std::vector<long long> etime_ms;
+   std::vector<long> etime;
+   std::vector<long> av_speed;
+   std::vector<long> curr_speed;
+   std::vector<int> delay_pool;
+   std::vector<Atom> peer;
+   // index of connection in SquidStats::connections
+   std::vector<uint32_t> conn;
+
+   size_t Size() const { return size.size(); }
+   void Clear();
+   void Swap(StatColumns& other);
+   void Append(const UriStats& stats, uint32_t conn);
+   // rows of other put in new places: row goes to place[row]
+   void Scatter(const StatColumns& other, const std::vector<uint32_t>& place);
+   UriStats Row(size_t row) const;
+   // rows of connection as UriStats in conn.stats
+   void Fill(SquidConnection& conn) const;
+};
+
+// Merges requests of connection to the same url in place.
+// Its index is kept between calls, so compacting many connections does not allocate.
+class UrlCompactor {
+   public:
+      // only first top urls are ordered by size, rest follow them in any order
+      void Compact(SquidConnection& conn, size_t top = SIZE_MAX);
+
+   private:
+      // url (string of atom) -> index of its first request in stats
+      FlatHash<const std::string*, size_t, PointerHash> index;
 };
 
 struct OldStat {
-   // out.size from previous stats
-   long long size;
-   // seconds ago from previous stats
-   long etime;
-   OldStat() : size(0), etime(0) {};
-   OldStat(long long size, long etime) : size(size), etime(etime) {};
+   // out.size of request by SquidStats::stamp of previous stats
+   RateMeter rate;
+   // GetInfo call which has seen request last time
+   unsigned long generation;
+   OldStat() : generation(0) {};
+};
+
+struct OldPeer {
+   // bytes transferred by all requests of peer since it was seen first time
+   RateMeter rate;
+   long long bytes;
+   unsigned long generation;
+   OldPeer() : bytes(0), generation(0) {};
+};
+
+// hash for request ids ("Connection: 0x..." parsed as number)
+struct RequestIdHash {
+   size_t operator () (uint64_t id) const {
+      id ^= id >> 33;
+      id *= 0xff51afd7ed558ccdULL;
+      id ^= id >> 33;
+      return static_cast<size_t>(id);
+   }
 };
 
 struct SquidStats {
    std::vector<SquidConnection> connections;
+   // requests of all connections
+   StatColumns stats;
+   // number of sqstat fetch that made snapshot, 0 for empty one
+   unsigned long generation;
+   // what connections are: hosts, or groups of requests made by Pivot::Group
+   Options::GROUP_BY group_by;
+   // owns strings of connections, shared by all copies of this snapshot
+   StringPoolRef strings;
+   // names of groups (peer of connections) in user and delay pool views
+   StringPoolRef group_names;
 
    long av_speed;
    long curr_speed;
 
-   time_t get_time;
-   time_t process_time;
+   // milliseconds spent on fetching and on processing stats
+   long long get_time;
+   long long process_time;
+   // monotonic time (Utils::MonotonicMs) when reply arrived, current speeds are
+   // computed from difference between stamps of two snapshots
+   long long stamp;
+
+   // read() calls and bytes spent on fetching active_requests
+   unsigned long read_calls;
+   unsigned long long read_bytes;
+   // squid address lookups made since start
+   unsigned long addr_lookups;
+
+   // active_requests lines and bytes parsed, microseconds spent in parser
+   unsigned long parse_lines;
+   unsigned long long parse_bytes;
+   long long parse_time;
+
+   // requests remembered for current speed and how many were forgotten
+   // after last fetch and since start
+   size_t oldstats_size;
+   unsigned long oldstats_evicted;
+   unsigned long long oldstats_evicted_total;
 
    int total_connections;
 
-   SquidStats() : av_speed(0), curr_speed(0), get_time(0), process_time(0), total_connections(0) {};
+   SquidStats() : generation(0), group_by(Options::GROUP_HOST), av_speed(0), curr_speed(0), get_time(0), process_time(0), stamp(0), read_calls(0), read_bytes(0), addr_lookups(0), parse_lines(0), parse_bytes(0), parse_time(0), oldstats_size(0), oldstats_evicted(0), oldstats_evicted_total(0), total_connections(0) {};
 };
 
 #define FAILED_TO_CONNECT 1
 #define FORMAT_CHANGED 2
 #define ACCESS_DENIED 3
 #define UNKNOWN_ERROR 4
+#define FETCH_TIMEOUT 5
+#define CANCELLED 6
 
 class sqstatException: public std::exception {
     public:
@@ -88,53 +198,95 @@ class sqstatException: public std::exception {
       ~sqstatException() throw() {}
 
       const char* what() const throw() { return userMessage.c_str(); }
+      int Code() const { return code; }
 
     private:
       std::string userMessage;
       int code;
 };
 
-class sqstat {
+class sqstat : private sqconnSink {
    public:
 #ifdef WITH_RESOLVER
-      sqstat(Options* pgOpts, Resolver* pResolver) : pOpts(pgOpts), pResolver(pResolver) {};
+      sqstat(Options* pgOpts, Resolver* pResolver) : generation(0), newStatsOpen(false), pOpts(pgOpts), pResolver(pResolver) {};
 #else
-      sqstat(Options* pgOpts) : pOpts(pgOpts) {};
+      sqstat(Options* pgOpts) : generation(0), newStatsOpen(false), pOpts(pgOpts) {};
 #endif
 
       SquidStats GetInfo();
+      // same as GetInfo, but result can be shared between threads without copying
+      SharedRef<SquidStats> GetSnapshot();
+      // aborts running and all further GetInfo calls (may be called from other thread)
+      void Cancel();
       std::string squid_version;
 
-      static bool CompareURLs(UriStats a, UriStats b);
-      static bool CompareIP(SquidConnection a, SquidConnection b);
+      static bool CompareURLs(const UriStats& a, const UriStats& b);
+      static bool CompareIP(const SquidConnection& a, const SquidConnection& b);
       static bool ConnByPeer(SquidConnection conn, std::string Host);
       static bool StatByID(UriStats stat, std::string id);
-      static void CompactSameUrls(std::vector<SquidConnection>& scon);
+      // only first top urls of each connection are ordered by size, rest follow them in any order
+      static void CompactSameUrls(std::vector<SquidConnection>& scon, size_t top = SIZE_MAX);
+      // users from filter as atoms of stats, to match them with Utils::UserMemberOf
+      static std::vector<Atom> FilterUsers(const SquidStats& stats, const std::vector<std::string>& users);
+      // connection is inside hosts filter, group is if any of its clients is
+      static bool HostMemberOf(const SubnetTrie& hosts, const SquidConnection& scon);
+      // computes average speeds of requests, orders connections by address and puts their rows
+      // together in grouped, sums rows of each connection; returns sum of average speeds
+      static long GroupStats(std::vector<SquidConnection>& connections, StatColumns& stats, StatColumns& grouped);
 
       static std::string HeadFormat(Options* pOpts, int active_conn, int active_ips, long av_speed);
       static std::string ConnFormat(Options* pOpts, SquidConnection& scon);
       static std::string StatFormat(Options* pOpts, SquidConnection& scon, UriStats& ustat);
       static std::string SpeedsFormat(Options::SPEED_MODE mode, long int av_speed, long int curr_speed);
 
-      static bool CompareSIZE(SquidConnection a, SquidConnection b);
-      static bool CompareTIME(SquidConnection a, SquidConnection b);
-      static bool CompareAVSPEED(SquidConnection a, SquidConnection b);
-      static bool CompareCURRSPEED(SquidConnection a, SquidConnection b);
-
    private:
       //std::vector<SquidConnection> connections;
-      std::map <std::string, SquidConnection> connections;
+      std::vector<SquidConnection> connections;
+      // index in connections by peer address
+      FlatHash<Utils::IPAddr, size_t, Utils::IPAddrHash> peers;
+      // requests in order they were parsed
+      StatColumns stats;
       //std::vector<SquidConnection> oldConnections;
       //std::map <std::string, SquidConnection> oldConnections;
-      std::map <std::string, OldStat> oldstats;
+      // progress of requests from previous GetInfo, requests not seen in last one are removed
+      FlatHash<uint64_t, OldStat, RequestIdHash> oldstats;
+      // same for peers, so speed of connection also counts requests started between GetInfo calls
+      FlatHash<Utils::IPAddr, OldPeer, Utils::IPAddrHash> oldpeers;
+      unsigned long generation;
+      void ExpireOldStats();
       //
       SquidStats sqstats;
 
+      // connection to squid, kept open between GetInfo calls in keep-alive mode
+      sqconn con;
+      void Connect();
+      std::string Request();
+      void ConnFailed(const sqconnException& e, int code, std::string context = "");
+      // cached "Authorization" header and password it was built for
+      std::string auth_pass;
+      std::string auth_header;
+
 #ifdef WITH_RESOLVER
-      std::string DoResolve(std::string peer);
+      // hosts moving more bytes are resolved first
+      std::string DoResolve(std::string peer, long long bytes);
 #endif
 
-      void FormatChanged(std::string line);
+      void FormatChanged(Utils::StrRef line);
+      // fetches and parses active_requests into result
+      void Fetch(SquidStats& result);
+
+      // active_requests parser state: request being parsed (one "Connection:" block)
+      UriStats newStats;
+      uint64_t newStatsKey;
+      Atom newPeer;
+      Utils::IPAddr newPeerAddr;
+      // reused buffer for lowercasing usernames
+      std::string lowered;
+      bool newStatsOpen;
+      // parses one line of active_requests, called by sqconn while reply arrives
+      void Line(const char* line, size_t len);
+      // adds completely parsed request to its connection
+      void CommitStats();
       //std::vector<SquidConnection>::iterator FindConnByPeer(std::string Host);
       //std::vector<UriStats>::iterator FindStatById(std::vector<SquidConnection>::iterator conn, std::string id);
       UriStats FindUriStatsById(std::vector<SquidConnection> conns, std::string id);
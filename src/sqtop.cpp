@@ -20,6 +20,8 @@
 #include "strings.hpp"
 #include "Utils.hpp"
 #include "ncui.hpp"
+#include "Sort.hpp"
+#include "Pivot.hpp"
 
 using std::string;
 using std::cout;
@@ -37,17 +39,24 @@ static struct option longopts[] = {
    { "hosts",              required_argument,   NULL,    'H' },
    { "users",              required_argument,   NULL,    'u' },
    { "pass",               required_argument,   NULL,    'P' },
+   { "connecttimeout",     required_argument,   NULL,    'T' },
+   { "fetchtimeout",       required_argument,   NULL,    't' },
    { "help",               no_argument,         NULL,     0  },
    { "brief",              no_argument,         NULL,    'b' },
    { "full",               no_argument,         NULL,    'f' },
    { "zero",               no_argument,         NULL,    'z' },
    { "detail",             no_argument,         NULL,    'd' },
+   { "top",                required_argument,   NULL,    'N' },
+   { "sort",               required_argument,   NULL,    'O' },
+   { "groupby",            required_argument,   NULL,    'g' },
    { NULL,                 no_argument,         NULL,    'Z' },
 #ifdef ENABLE_UI
    { "once",               no_argument,         NULL,    'o' },
    { "refreshinterval",    required_argument,   NULL,    'r' },
+   { "ratewindow",         required_argument,   NULL,    'w' },
 #endif
    { NULL,                 no_argument,         NULL,    'c' },
+   { NULL,                 no_argument,         NULL,    'K' },
 #ifdef WITH_RESOLVER
    { NULL,                 no_argument,         NULL,    'n' },
    { NULL,                 no_argument,         NULL,    'S' },
@@ -61,9 +70,9 @@ void usage(char* argv) {
    cout << "version " << VERSION << " " << copyright << " (" << contacts << ")" << endl;
    cout << endl;
    cout << "Usage:";
-   cout << "\n" << argv << " [--help] [--host host] [--port port] [--pass password] [--hosts host1,host...] [--users user1,user2] [--brief] [--detail] [--full] [--zero] [-c] [-Z]";
+   cout << "\n" << argv << " [--help] [--host host] [--port port] [--pass password] [--connecttimeout ms] [--fetchtimeout ms] [--hosts host1,host...] [--users user1,user2] [--brief] [--detail] [--full] [--zero] [--top N] [--sort keys] [--groupby what] [-c] [-Z] [-K]";
 #ifdef ENABLE_UI
-   cout << " [--once] [-r seconds]";
+   cout << " [--once] [-r seconds] [-w window]";
 #endif
 #ifdef WITH_RESOLVER
    cout << " [-n] [-S]";
@@ -72,17 +81,24 @@ void usage(char* argv) {
    cout << "\n\t--host   (-h) host           - " << host_help << ". Default - '127.0.0.1';";
    cout << "\n\t--port   (-p) port           - " << port_help << ". Default - '3128';";
    cout << "\n\t--pass   (-P) password       - " << passwd_help << ";";
+   cout << "\n\t--connecttimeout (-T) ms      - " << connect_timeout_help << ". Default - '3000';";
+   cout << "\n\t--fetchtimeout (-t) ms        - " << fetch_timeout_help << ". Default - '10000';";
    cout << "\n\t--hosts  (-H) host1,host2... - " << hosts_help << ";";
    cout << "\n\t--users  (-u) user1,user2... - " << users_help << ";";
    cout << "\n\t--brief  (-b)                - " << brief_help << ";";
    cout << "\n\t--detail (-d)                - " << detail_help << ";";
    cout << "\n\t--full   (-f)                - " << full_help << ";";
    cout << "\n\t--zero   (-z)                - " << zero_help << ";";
+   cout << "\n\t--top    (-N) N              - " << top_help << ";";
+   cout << "\n\t--sort   (-O) key1,key2...   - " << sort_help << ". Default - 'size';";
+   cout << "\n\t--groupby (-g) what          - " << group_by_help << ". Default - 'host';";
    cout << "\n\t-c                           - do not " << compact_same_help << ";";
    cout << "\n\t-Z                           - do not " << strip_user_domain_help << ";";
+   cout << "\n\t-K                           - do not " << keepalive_help << ";";
 #ifdef ENABLE_UI
    cout << "\n\t--once   (-o)                - disable interactive mode, just print statistics once to stdout;";
    cout << "\n\t--refreshinterval (-r) sec   - " << refresh_interval_help << ";";
+   cout << "\n\t--ratewindow (-w) window      - " << rate_window_help << ". Default - 'last';";
 #endif
 #ifdef WITH_RESOLVER
    cout << "\n\t-n                           - do not " << dns_resolution_help << ";";
@@ -99,27 +115,51 @@ bool DESC(int a, int b) {
    return a > b;
 }
 
-string conns_format(Options* pOpts, vector<SquidConnection> conns) {
+// connections are printed in address order unless sorted is set or only top of them are printed
+string conns_format(Options* pOpts, SquidStats& sqstats, bool sorted) {
    std::stringstream result;
+   vector<Atom> users = sqstat::FilterUsers(sqstats, pOpts->Users);
+
+   vector<const SquidConnection*> filtered;
+   for (vector<SquidConnection>::const_iterator it = sqstats.connections.begin(); it != sqstats.connections.end(); ++it) {
+      if (((pOpts->Hosts.size() == 0) || sqstat::HostMemberOf(pOpts->hosts_filter, *it)) &&
+         ((pOpts->Users.size() == 0) || Utils::UserMemberOf(users, it->usernames)))
+         filtered.push_back(&*it);
+   }
+   // tree keeps its own order
+   bool tree = pOpts->TreeView();
+   if ((pOpts->top > 0) && !tree)
+      filtered = Sort::Top(filtered, pOpts->sort_keys, pOpts->top);
+   else if (sorted && !tree)
+      filtered = Sort::Top(filtered, pOpts->sort_keys);
+
+   vector<SquidConnection> conns;
+   conns.reserve(filtered.size());
+   for (vector<const SquidConnection*>::iterator it = filtered.begin(); it != filtered.end(); ++it) {
+      conns.push_back(**it);
+      sqstats.stats.Fill(conns.back());
+   }
 
    if (pOpts->compactsameurls)
       sqstat::CompactSameUrls(conns);
 
    for (vector<SquidConnection>::iterator it = conns.begin(); it != conns.end(); ++it) {
-      if (((pOpts->Hosts.size() == 0) || Utils::IPMemberOf(pOpts->Hosts, it->peer)) &&
-         ((pOpts->Users.size() == 0) || Utils::UserMemberOf(pOpts->Users, it->usernames))) {
-
-         result << sqstat::ConnFormat(pOpts, *it);
+      string indent(2 * it->depth, ' ');
+      result << indent << sqstat::ConnFormat(pOpts, *it);
 
-         if (not pOpts->brief) {
+      // row of tree without requests (subnet) is followed by its rows right away
+      if (tree && (it->stats_count == 0)) {
+         result << endl;
+         continue;
+      }
+      if (not pOpts->brief) {
+         result << endl;
+         for (vector<UriStats>::iterator itu = it->stats.begin(); itu != it->stats.end(); ++itu) {
+            result << indent << sqstat::StatFormat(pOpts, *it, *itu);
             result << endl;
-            for (vector<UriStats>::iterator itu = it->stats.begin(); itu != it->stats.end(); ++itu) {
-               result << sqstat::StatFormat(pOpts, *it, *itu);
-               result << endl;
-            }
          }
-      result << endl;
       }
+      result << endl;
    }
    return result.str();
 }
@@ -129,22 +169,25 @@ struct thread_args {
    ncui* ui;
    Options* pOpts;
    sqstat *pSqstat;
+   // set by main thread to stop squid_loop (accessed with atomic builtins)
+   int stop;
 };
 
 void squid_loop(void* threadarg) {
    thread_args* pArgs = reinterpret_cast<thread_args*>(threadarg);
-   while (true) {
+   while (!__atomic_load_n(&pArgs->stop, __ATOMIC_ACQUIRE)) {
       if (pArgs->pOpts->do_refresh) {
          try {
-            pArgs->ui->SetStat( pArgs->pSqstat->GetInfo() );
+            pArgs->ui->SetStat( pArgs->pSqstat->GetSnapshot() );
             pArgs->ui->ClearError();
          }
          catch (sqstatException &e) {
+            if (e.Code() == CANCELLED) break;
             pArgs->ui->SetError(e.what());
          }
          pArgs->ui->Tick();
       }
-      for (int i=0; i<pArgs->pOpts->sleep_sec; ++i) {
+      for (int i=0; (i<pArgs->pOpts->sleep_sec) && !__atomic_load_n(&pArgs->stop, __ATOMIC_ACQUIRE); ++i) {
          sleep(1);
       }
    }
@@ -155,12 +198,13 @@ int main(int argc, char **argv) {
    // TODO: config file ?
    int ch;
    string tempusers;
+   bool sorted = false;
 
    sqtop::Options* pOpts = new Options();
 
-   string getopt_options = "u:H:h:p:P:dzbfc";
+   string getopt_options = "u:H:h:p:P:T:t:N:O:g:dzbfcK";
 #ifdef ENABLE_UI
-   getopt_options += "r:o";
+   getopt_options += "r:ow:";
 #endif
 #ifdef WITH_RESOLVER
    getopt_options += "nS";
@@ -195,8 +239,69 @@ int main(int argc, char **argv) {
                exit(1);
             }
             break;
+         case 'T':
+         case 't':
+            try {
+               long int ms = Utils::stol(optarg);
+               if (ms < 0) throw std::range_error("should not be negative");
+               if (ch == 'T')
+                  pOpts->connect_timeout = ms;
+               else
+                  pOpts->fetch_timeout = ms;
+            }
+            catch (const std::exception& error) {
+               cerr << "Wrong timeout - '" << optarg << "' (" << error.what() << ")" << endl;
+               exit(1);
+            }
+            break;
+         case 'N':
+            try {
+               long int top = Utils::stol(optarg);
+               if (top <= 0) throw std::range_error("should be greater than 0");
+               pOpts->top = top;
+            }
+            catch (const std::exception& error) {
+               cerr << "Wrong number of connections - '" << optarg << "' (" << error.what() << ")" << endl;
+               exit(1);
+            }
+            break;
+         case 'O':
+            try {
+               pOpts->sort_keys = Sort::Parse(optarg);
+               sorted = true;
+            }
+            catch (const std::exception& error) {
+               cerr << "Wrong sort order - '" << optarg << "' (" << error.what() << ")" << endl;
+               exit(1);
+            }
+            break;
+         case 'g': {
+            string group = optarg;
+            if (group == "host") {
+               pOpts->group_by = Options::GROUP_HOST;
+            } else if (group == "user") {
+               pOpts->group_by = Options::GROUP_USER;
+            } else if (group == "pool") {
+               pOpts->group_by = Options::GROUP_DELAY_POOL;
+            } else if (group == "subnet") {
+               pOpts->group_by = Options::GROUP_SUBNET;
+            } else if (group == "domain") {
+               pOpts->group_by = Options::GROUP_DOMAIN;
+            } else {
+               cerr << "Wrong grouping - '" << optarg << "' (should be host, user, pool, subnet or domain)" << endl;
+               exit(1);
+            }
+            break;
+         }
          case 'H':
             pOpts->Hosts = Utils::SplitString(optarg, ",");
+            try {
+               pOpts->hosts_filter.Compile(pOpts->Hosts);
+            }
+            catch (const std::exception& error) {
+               cerr << "Wrong hosts - '" << optarg << "' (" << error.what() << ")" << endl;
+               exit(1);
+            }
             break;
          case 'u':
             tempusers = optarg;
@@ -221,6 +326,24 @@ int main(int argc, char **argv) {
                exit(1);
             }
             break;
+         case 'w': {
+            string window = optarg;
+            if (window == "last") {
+               pOpts->rate_window = Options::RATE_LAST;
+            } else if (window == "5s") {
+               pOpts->rate_window = Options::RATE_5S;
+            } else if (window == "30s") {
+               pOpts->rate_window = Options::RATE_30S;
+            } else if (window == "60s") {
+               pOpts->rate_window = Options::RATE_60S;
+            } else if (window == "ewma") {
+               pOpts->rate_window = Options::RATE_EWMA;
+            } else {
+               cerr << "Wrong rate window - '" << optarg << "' (should be last, 5s, 30s, 60s or ewma)" << endl;
+               exit(1);
+            }
+            break;
+         }
 #endif
 #ifdef WITH_RESOLVER
          case 'n':
@@ -236,6 +359,9 @@ int main(int argc, char **argv) {
          case 'Z':
             pOpts->strip_user_domain = false;
             break;
+         case 'K':
+            pOpts->keepalive = false;
+            break;
          default:
             usage(argv[0]);
             exit(0);
@@ -269,6 +395,7 @@ int main(int argc, char **argv) {
       args.ui = ui;
       args.pOpts = pOpts;
       args.pSqstat = pSqstat;
+      args.stop = 0;
 #ifdef WITH_RESOLVER
       pResolver->Start(MAX_THREADS);
       pResolver->resolve_mode = Resolver::RESOLVE_ASYNC;
@@ -279,7 +406,10 @@ int main(int argc, char **argv) {
 
       ui->Loop();
 
-      pthread_cancel(sq_thread);
+      // abort fetch in progress (if any) and wait for squid_loop to finish
+      __atomic_store_n(&args.stop, 1, __ATOMIC_RELEASE);
+      pSqstat->Cancel();
+      pthread_join(sq_thread, NULL);
       ui->CursesFinish();
       delete ui;
    } else {
@@ -289,6 +419,8 @@ int main(int argc, char **argv) {
       pResolver->resolve_mode = Resolver::RESOLVE_SYNC;
 #endif
       pOpts->speed_mode = Options::SPEED_AVERAGE;
+      // single request, nothing to keep connection open for
+      pOpts->keepalive = false;
       try {
          sqstats = pSqstat->GetInfo();
       }
@@ -297,7 +429,13 @@ int main(int argc, char **argv) {
          exit(1);
       }
       cout << sqstat::HeadFormat(pOpts, sqstats.total_connections, sqstats.connections.size(), sqstats.av_speed) << endl;
-      cout << conns_format(pOpts, sqstats.connections) << endl;
+      if (pOpts->group_by != Options::GROUP_HOST) {
+         SquidStats groups;
+         Pivot::Group(sqstats, pOpts->group_by, pOpts->strip_user_domain, groups);
+         cout << conns_format(pOpts, groups, sorted) << endl;
+      } else {
+         cout << conns_format(pOpts, sqstats, sorted) << endl;
+      }
 #ifdef ENABLE_UI
    }
 #endif
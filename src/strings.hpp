@@ -11,14 +11,21 @@
 #define full_help "display full details (size, username, average speed, delay pool and elapsed time) for each URL in each connection"
 #define zero_help "display zero values instead of silently omitting them"
 #define brief_help "display brief per-connection information, omits URLs"
-#define hosts_help "comma-separated list of clients (by ip[/mask]) to show"
+#define hosts_help "comma-separated list of clients (by IPv4 or IPv6 ip[/bits], or IPv4 ip/mask) to show"
 #define users_help "comma-separated list of clients (by login) to show"
+#define top_help "print only first N connections in sort order (non-interactive mode)"
+#define sort_help "order of connections by keys size, speed, avspeed, time, ip, user or requests (with + or - for ascending or descending order), equal by first key are ordered by next one"
+#define group_by_help "group requests into connections by client host, user (with domain stripped unless -Z is given), delay pool, subnet (tree of /16 and /24 subnets, /48 and /64 for IPv6) or destination domain (tree of domains and their subdomains)"
 #define compact_same_help "compact the display of multiple occurrences of the same URL in a single connection"
 #define strip_user_domain_help "strip domain part of username"
 #define host_help "address of Squid server"
 #define port_help "port of Squid server"
 #define passwd_help "manager password"
 #define refresh_interval_help "set the refresh-interval for interactive mode"
+#define rate_window_help "time current speed is averaged over (last - between two last refreshes, 5s, 30s, 60s or ewma)"
+#define keepalive_help "keep connection to Squid open between refreshes"
+#define connect_timeout_help "time limit for connecting to Squid in milliseconds (0 - no limit)"
+#define fetch_timeout_help "time limit for fetching statistics from Squid in milliseconds (0 - no limit)"
 
 #ifdef WITH_RESOLVER
 #define dns_resolution_help "do hostname lookups"